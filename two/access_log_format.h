@@ -0,0 +1,48 @@
+// قالب فایل لاگ دسترسی دودویی؛ مشترک بین webserverbest (نویسنده) و logdecode (خواننده).
+//
+// ساختار فایل:
+//   [سرآیند ۴۰۹۶ بایتی: AccessLogFileHeader + جدول نام مسیرها]
+//   [capacity رکورد ۳۲ بایتی AccessLogRecord]
+// فایل با اندازه کامل ساخته و mmap می‌شود؛ رکوردی که timestamp_us آن صفر است هنوز نوشته نشده است.
+// جدول مسیرها متنی است، هر خط: "<شناسه>\t<متد> <الگو>\n".
+// اعداد با ترتیب بایت ماشین نویسنده (little-endian در x86/arm64) ذخیره می‌شوند.
+
+#ifndef ACCESS_LOG_FORMAT_H
+#define ACCESS_LOG_FORMAT_H
+
+#include <cstdint>
+#include <cstddef>
+
+const char ACCESS_LOG_MAGIC[8] = {'W', 'S', 'A', 'C', 'C', 'L', 'O', 'G'};
+const uint32_t ACCESS_LOG_VERSION = 1;
+const size_t ACCESS_LOG_HEADER_SIZE = 4096;
+
+struct AccessLogFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;           // تعداد خانه‌های رکورد پس از سرآیند
+    uint64_t created_us;         // زمان ساخت فایل (میکروثانیه از epoch)
+    uint32_t route_table_length; // طول جدول مسیرها که بلافاصله پس از این ساختار می‌آید
+    uint32_t reserved;
+};
+
+struct AccessLogRecord {
+    uint64_t timestamp_us;   // زمان دریافت درخواست (میکروثانیه از epoch)
+    uint64_t bytes_sent;     // کل بایت‌های پاسخ شامل هدرها
+    uint32_t latency_us;     // از پایان تجزیه هدرها تا ارسال پاسخ
+    uint32_t bytes_received; // هدرها و بدنه درخواست
+    uint16_t status;
+    uint8_t method;          // اندیس در HTTP_METHOD_NAMES
+    uint8_t route_id;        // شناسه در جدول مسیرهای سرآیند؛ 0 یعنی بدون تطبیق
+    uint32_t reserved;
+};
+
+static_assert(sizeof(AccessLogFileHeader) == 40, "access log header layout changed");
+static_assert(sizeof(AccessLogRecord) == 32, "access log record layout changed");
+
+// هم‌ترتیب با enum HttpMethod در webserverbest.cpp
+const char* const HTTP_METHOD_NAMES[] = {"GET", "HEAD", "POST", "PUT", "PATCH", "DELETE", "OPTIONS", "OTHER"};
+const size_t HTTP_METHOD_COUNT = sizeof(HTTP_METHOD_NAMES) / sizeof(HTTP_METHOD_NAMES[0]);
+
+#endif
@@ -0,0 +1,163 @@
+// logdecode: تبدیل لاگ دسترسی دودویی webserverbest به CSV یا JSON (خطوط JSON، یک شیء در هر خط)
+//
+// استفاده:
+//   logdecode access.bin.2 access.bin.1 access.bin > access.csv
+//   logdecode --json access.bin | jq 'select(.status >= 500)'
+//
+// کامپایل: g++ logdecode.cpp -o logdecode -std=c++17 -O2
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <time.h>
+#include "access_log_format.h"
+
+using namespace std;
+
+struct DecodeOptions {
+    bool json = false;
+    vector<string> files;
+};
+
+// جدول مسیرهای سرآیند: خط i ام "<شناسه>\t<متد> <الگو>"
+vector<string> parse_route_table(const string& table) {
+    vector<string> routes;
+    size_t start = 0;
+    while (start < table.length()) {
+        size_t end = table.find('\n', start);
+        if (end == string::npos) end = table.length();
+        string line = table.substr(start, end - start);
+        size_t tab = line.find('\t');
+        if (tab != string::npos) {
+            size_t id = stoul(line.substr(0, tab));
+            if (id >= routes.size()) routes.resize(id + 1);
+            routes[id] = line.substr(tab + 1);
+        }
+        start = end + 1;
+    }
+    return routes;
+}
+
+// زمان UTC با دقت میلی‌ثانیه به قالب ISO 8601
+string format_iso_time(uint64_t timestamp_us) {
+    time_t seconds = timestamp_us / 1000000;
+    struct tm tm_utc;
+    gmtime_r(&seconds, &tm_utc);
+    char buffer[40];
+    size_t length = strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &tm_utc);
+    snprintf(buffer + length, sizeof(buffer) - length, ".%03uZ", (unsigned)(timestamp_us % 1000000 / 1000));
+    return buffer;
+}
+
+string json_escape(const string& text) {
+    string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+string csv_field(const string& text) {
+    if (text.find_first_of(",\"\n") == string::npos) return text;
+    string out = "\"";
+    for (char c : text) {
+        if (c == '"') out += '"';
+        out += c;
+    }
+    return out + "\"";
+}
+
+bool decode_file(const string& path, const DecodeOptions& options) {
+    ifstream file(path, ios::binary);
+    if (!file) {
+        cerr << "خطا در باز کردن فایل: " << path << endl;
+        return false;
+    }
+
+    AccessLogFileHeader header;
+    if (!file.read((char*)&header, sizeof(header)) || memcmp(header.magic, ACCESS_LOG_MAGIC, sizeof(header.magic)) != 0) {
+        cerr << path << ": فایل لاگ دسترسی معتبر نیست." << endl;
+        return false;
+    }
+    if (header.version != ACCESS_LOG_VERSION || header.record_size != sizeof(AccessLogRecord) ||
+        header.route_table_length > ACCESS_LOG_HEADER_SIZE - sizeof(header)) {
+        cerr << path << ": نسخه قالب پشتیبانی نمی‌شود (" << header.version << ")." << endl;
+        return false;
+    }
+
+    string table(header.route_table_length, '\0');
+    file.read(&table[0], table.length());
+    vector<string> routes = parse_route_table(table);
+
+    file.seekg(ACCESS_LOG_HEADER_SIZE);
+    vector<AccessLogRecord> batch(4096);
+    uint64_t remaining = header.capacity;
+    while (remaining > 0 && file) {
+        size_t wanted = min<uint64_t>(remaining, batch.size());
+        file.read((char*)batch.data(), wanted * sizeof(AccessLogRecord));
+        size_t count = file.gcount() / sizeof(AccessLogRecord);
+        remaining -= count;
+
+        for (size_t i = 0; i < count; ++i) {
+            const AccessLogRecord& record = batch[i];
+            if (record.timestamp_us == 0) continue; // خانه رزرو نشده یا هنوز نوشته نشده
+
+            string method = record.method < HTTP_METHOD_COUNT ? HTTP_METHOD_NAMES[record.method] : "OTHER";
+            string route = record.route_id < routes.size() ? routes[record.route_id] : "";
+            if (options.json) {
+                cout << "{\"timestamp_us\":" << record.timestamp_us
+                     << ",\"time\":\"" << format_iso_time(record.timestamp_us)
+                     << "\",\"method\":\"" << method
+                     << "\",\"route_id\":" << (unsigned)record.route_id
+                     << ",\"route\":\"" << json_escape(route)
+                     << "\",\"status\":" << record.status
+                     << ",\"bytes_sent\":" << record.bytes_sent
+                     << ",\"bytes_received\":" << record.bytes_received
+                     << ",\"latency_us\":" << record.latency_us << "}\n";
+            } else {
+                cout << record.timestamp_us << ',' << format_iso_time(record.timestamp_us) << ',' << method << ','
+                     << (unsigned)record.route_id << ',' << csv_field(route) << ',' << record.status << ','
+                     << record.bytes_sent << ',' << record.bytes_received << ',' << record.latency_us << '\n';
+            }
+        }
+        if (count < wanted) break; // فایل ناقص (مثلاً کپی شده در حین نوشتن)
+    }
+    return true;
+}
+
+void print_usage(const char* program) {
+    cerr << "Usage: " << program << " [--json] FILE..." << endl;
+    cerr << "  خروجی پیش‌فرض CSV با سطر عنوان است؛ --json یک شیء JSON در هر خط می‌نویسد." << endl;
+    cerr << "  فایل‌ها به همان ترتیب داده شده خوانده می‌شوند (قدیمی‌ترین را اول بدهید)." << endl;
+}
+
+int main(int argc, char* argv[]) {
+    DecodeOptions options;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--json") {
+            options.json = true;
+        } else if (arg == "--help" || (arg.length() > 1 && arg[0] == '-')) {
+            print_usage(argv[0]);
+            return arg == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+        } else {
+            options.files.push_back(arg);
+        }
+    }
+    if (options.files.empty()) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    ios::sync_with_stdio(false);
+    if (!options.json) cout << "timestamp_us,time,method,route_id,route,status,bytes_sent,bytes_received,latency_us\n";
+
+    bool ok = true;
+    for (const string& path : options.files) {
+        ok = decode_file(path, options) && ok;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <cstring>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <fstream>
 #include <unistd.h>
@@ -19,46 +20,846 @@
 #include <dirent.h>
 #include <errno.h>
 #include <vector>
+#include <array>
+#include <utility>
+#include <stdexcept>
+#include <charconv>
 #include <memory>
 #include <shared_mutex>
 #include <functional>
+#include <queue>
+#include <condition_variable>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <list>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <deque>
+#include <chrono>
+#include <cmath>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
 #include <sqlite3.h> // کتابخانه SQLite3
+#include <zlib.h> // ساخت نسخه‌های gzip فایل‌های استاتیک
+#include <brotli/encode.h> // ساخت نسخه‌های brotli فایل‌های استاتیک
+#include "access_log_format.h" // قالب لاگ دسترسی دودویی (مشترک با logdecode)
 
 using namespace std;
 
 // --- تنظیمات ثابت (Const Settings) ---
 const int PORT = 8080;
-const int BACKLOG = 10;
+const int BACKLOG = 1024; // پیش‌فرض صف اتصال‌های در انتظار accept (کرنل آن را به somaxconn محدود می‌کند)
 const int BUFFER_SIZE = 4096;
+const int MAX_EVENTS = 1024; // حداکثر رویدادهای epoll در هر فراخوانی epoll_wait
+const int WORKER_THREADS = 0; // 0 یعنی دو برابر تعداد هسته‌های CPU
+const size_t STATIC_CACHE_MAX_BYTES = 64 * 1024 * 1024; // سقف حافظه کش فایل‌های استاتیک
+const size_t STATIC_CACHE_MAX_FILE = 256 * 1024; // فایل‌های بزرگ‌تر همیشه از دیسک ارسال می‌شوند (sendfile، یا READ در io_uring)
+const int MAX_CONNECTIONS = 10000; // سقف اتصال‌های باز هم‌زمان؛ به محدودیت RLIMIT_NOFILE هم محدود می‌شود
+const int MAX_CONNECTIONS_PER_IP = 256;
+const int SHED_QUEUE_DEPTH = 1024; // با این تعداد کار منتظر در استخر نخ، اتصال‌های جدید با 503 رد می‌شوند
+const int RETRY_AFTER_SECONDS = 1;
+const int HEADER_TIMEOUT_MS = 10000; // مهلت دریافت کامل هدرهای هر درخواست (از اولین بایت یا پذیرش اتصال)
+const int BODY_TIMEOUT_MS = 30000; // حداکثر فاصله بین دو دریافت در حین خواندن بدنه (آپلود کند)
+const int KEEPALIVE_TIMEOUT_MS = 15000; // حداکثر بیکاری اتصال keep-alive بین دو درخواست
+const int WRITE_TIMEOUT_MS = 10000; // حداکثر توقف ارسال وقتی کلاینت داده‌ها را نمی‌خواند
+const uint64_t TIMER_TICK_MS = 100; // دقت چرخ زمان‌سنج مهلت‌ها
+const size_t MAX_HEADER_SIZE = 16 * 1024; // حداکثر اندازه خط اول و هدرهای یک درخواست
+const size_t MAX_HEADER_COUNT = 100;
+const size_t INPUT_BUFFER_KEEP = 64 * 1024; // بافر ورودی بزرگ‌تر از این پس از خالی شدن آزاد می‌شود
+const size_t MAX_BUFFERED_BODY = 1024 * 1024; // بدنه‌های بزرگ‌تر به صورت جریانی توسط هندلر خوانده می‌شوند
+const size_t STREAM_CHUNK_SIZE = 16 * 1024; // اندازه هر فریم پاسخ chunked (مثلاً خروجی جریانی /api/users)
+const size_t SEND_IOV_BATCH = 64; // حداکثر تکه‌های صف خروجی که با یک sendmsg ارسال می‌شوند
+const int64_t USERS_MAX_LIMIT = 10000; // سقف پارامتر limit در GET /api/users
+const size_t PRECOMPRESS_MIN_FILE = 256; // فایل‌های کوچک‌تر ارزش نسخه فشرده ندارند
+const size_t PRECOMPRESS_MAX_FILE = 8 * 1024 * 1024;
+const size_t MAX_BYTE_RANGES = 16; // درخواست Range با بازه‌های بیشتر نادیده گرفته و کل فایل ارسال می‌شود
+const unsigned URING_ENTRIES = 1024; // اندازه صف ارسال (SQ) هر حلقه io_uring
+const unsigned URING_BUFFER_COUNT = 256; // تعداد بافرهای فراهم‌شده برای recv چندباره
+const unsigned URING_BUFFER_SIZE = 16 * 1024;
+const size_t URING_SEND_HIGH_WATERMARK = 256 * 1024; // بیش از این داده منتظر ارسال، نخ پردازشگر اتصال را تا تخلیه رها می‌کند
+const size_t URING_FILE_READ_SIZE = 128 * 1024; // هر READ بازه فایل در موتور io_uring (بافر جداگانه هر اتصال)
+const size_t URING_MAX_INCOMING = MAX_HEADER_SIZE + MAX_BUFFERED_BODY; // بیش از این، recv تا تخلیه ورودی متوقف می‌شود
+const size_t LOG_RING_RECORDS = 1024; // ظرفیت صف لاگ هر نخ (توان ۲)؛ در صورت پر شدن پیام دور ریخته و شمرده می‌شود
+const size_t LOG_RECORD_TEXT = 240;   // پیام‌های بلندتر کوتاه می‌شوند
+const size_t COUNTER_SHARDS = 64; // خانه‌های هر ShardedCounter (توان ۲)؛ نخ‌های بیشتر خانه مشترک می‌گیرند
+const uint64_t ACCESS_LOG_RECORDS = 256 * 1024; // ظرفیت هر فایل لاگ دسترسی (۸ مگابایت)؛ پس از پر شدن فایل چرخانده می‌شود
+const int ACCESS_LOG_FILES = 4; // تعداد فایل‌های قدیمی نگه‌داشته‌شده (access.bin.1 تا access.bin.4)
 const string WEB_ROOT = "www";
 const string UPLOAD_ROOT = "uploads";
 const string DB_PATH = "server_db.sqlite"; // مسیر دیتابیس
+const int DB_READ_CONNECTIONS = 4; // اتصال‌های فقط‌خواندنی SQLite (در کنار یک اتصال نویسنده)
+const int DB_BUSY_TIMEOUT_MS = 5000; // انتظار SQLite برای قفل فایل، و انتظار خواندن‌ها برای اتصال آزاد استخر
+const long long DB_MMAP_SIZE = 256LL * 1024 * 1024; // PRAGMA mmap_size برای هر اتصال
+const size_t DB_STATEMENT_CACHE_SIZE = 32; // statementهای آماده نگه‌داشته‌شده در هر اتصال (LRU)
+const string ACCESS_LOG_PATH = "access.bin";
 
 // --- منابع عمومی و همزمان ---
-atomic<int> counter(0); // شمارنده اتمیک برای تست Multi-thread
 mutex cout_mutex; // قفل برای لاگ‌گیری ایمن
-mutex db_connection_mutex; // قفل برای دسترسی به شیء اتصال SQLite
+
+// --- پیکربندی زمان اجرا (از آرگومان‌های خط فرمان) ---
+enum class LogLevel : uint8_t { DEBUG, INFO, WARN, ERROR };
+
+struct ServerConfig {
+    int worker_threads = WORKER_THREADS;
+    bool reuseport = false; // یک سوکت شنونده و یک حلقه رویداد برای هر هسته (SO_REUSEPORT)
+    int acceptors = 0; // تعداد حلقه‌های پذیرش در حالت reuseport؛ 0 یعنی به تعداد CPUهای مجاز
+    string io_engine = "epoll"; // "epoll" یا "uring" (در صورت عدم پشتیبانی کرنل به epoll برمی‌گردد)
+    LogLevel log_level = LogLevel::INFO; // پیام‌های پایین‌تر از این سطح اصلاً در صف قرار نمی‌گیرند
+    string access_log_path = ACCESS_LOG_PATH; // خالی یعنی لاگ دسترسی خاموش
+    int header_timeout_ms = HEADER_TIMEOUT_MS;
+    int body_timeout_ms = BODY_TIMEOUT_MS;
+    int keepalive_timeout_ms = KEEPALIVE_TIMEOUT_MS;
+    int write_timeout_ms = WRITE_TIMEOUT_MS;
+    int listen_backlog = BACKLOG;
+    int max_connections = MAX_CONNECTIONS; // 0 یعنی بدون سقف
+    int max_connections_per_ip = MAX_CONNECTIONS_PER_IP; // 0 یعنی بدون سقف
+    int shed_queue_depth = SHED_QUEUE_DEPTH; // 0 یعنی غیرفعال
+    int retry_after_seconds = RETRY_AFTER_SECONDS;
+    int db_readers = DB_READ_CONNECTIONS;
+    int db_busy_timeout_ms = DB_BUSY_TIMEOUT_MS;
+};
+ServerConfig server_config;
 
 // --- توابع کمکی پروتکلی (Forward Declarations) ---
+class Connection;
 string sanitize_path(string path);
-string build_http_response(const string& content, int status_code, const string& content_type);
+struct HttpResponse;
+HttpResponse build_http_response(string content, int status_code, string_view content_type = "text/html");
+void send_response(Connection& conn, HttpResponse response);
 string build_http_response_cacheable(long file_size, const string& content_type);
 string get_mime_type(const string& file_path);
-void serve_static_file(int client_socket, const string& full_path);
+class Request;
+void serve_static_file(Connection& conn, const string& full_path, const Request& request);
 string list_files(const string& upload_dir);
-void handle_upload_stream(int client_socket, const string& initial_body, long content_length);
+void handle_upload_stream(Connection& conn, string_view initial_body, long content_length);
+
+// ----------------------------------------------------------------------
+// --- ساعت سرور: زمان قالب‌بندی‌شده که هر ثانیه یک‌بار به‌روز می‌شود ---
+// ----------------------------------------------------------------------
+
+struct ClockSnapshot {
+    time_t now;
+    char date_header[48];   // "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n" (RFC 7231)
+    size_t date_header_length;
+    char log_time[16];      // "HH:MM:SS" به وقت محلی
+    char file_stamp[16];    // "YYYYmmddHHMMSS" به وقت محلی (برای نام فایل‌ها)
+};
+
+// یک نخ پس‌زمینه هر ثانیه زمان را قالب‌بندی و با یک اشاره‌گر atomic منتشر می‌کند؛ مسیرهای داغ
+// دیگر time/localtime (که قفل داخلی libc را می‌گیرد) صدا نمی‌زنند. چند خانه چرخشی داریم تا
+// خواننده‌ای که اشاره‌گر قبلی را گرفته، تا چند ثانیه بعد هم داده سالم ببیند.
+class Timekeeper {
+private:
+    static const size_t SLOTS = 4;
+    ClockSnapshot slots[SLOTS];
+    size_t next_slot;
+    atomic<const ClockSnapshot*> current;
+
+    void update() {
+        ClockSnapshot& snapshot = slots[next_slot];
+        next_slot = (next_slot + 1) % SLOTS;
+
+        snapshot.now = time(nullptr);
+        struct tm tm_utc, tm_local;
+        gmtime_r(&snapshot.now, &tm_utc);
+        localtime_r(&snapshot.now, &tm_local);
+        snapshot.date_header_length = strftime(snapshot.date_header, sizeof(snapshot.date_header),
+                                               "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm_utc);
+        strftime(snapshot.log_time, sizeof(snapshot.log_time), "%H:%M:%S", &tm_local);
+        strftime(snapshot.file_stamp, sizeof(snapshot.file_stamp), "%Y%m%d%H%M%S", &tm_local);
+        current.store(&snapshot, memory_order_release);
+    }
+
+public:
+    Timekeeper() : next_slot(0), current(nullptr) { update(); }
+
+    void start() {
+        thread([this] {
+            while (true) {
+                // بیدار شدن درست پس از مرز ثانیه بعد تا Date با ساعت دیواری هم‌گام بماند
+                auto now = chrono::system_clock::now();
+                auto next_second = chrono::time_point_cast<chrono::seconds>(now) + chrono::seconds(1);
+                this_thread::sleep_until(next_second);
+                update();
+            }
+        }).detach();
+    }
+
+    const ClockSnapshot& now() const { return *current.load(memory_order_acquire); }
+};
+
+Timekeeper server_clock;
 
 // ----------------------------------------------------------------------
 // --- تابع کمکی لاگ‌گیری (تمیز کردن خروجی کنسول) ---
 // ----------------------------------------------------------------------
 
+// رکورد خام لاگ؛ قالب‌بندی زمان و پیشوند به نخ نویسنده واگذار می‌شود
+struct LogRecord {
+    time_t time;
+    uint16_t length;
+    LogLevel level;
+    bool truncated;
+    char text[LOG_RECORD_TEXT];
+};
+
+// صف حلقوی تک‌تولیدکننده/تک‌مصرف‌کننده (SPSC) هر نخ؛ تولیدکننده هیچ قفلی نمی‌گیرد
+struct ThreadLogBuffer {
+    LogRecord records[LOG_RING_RECORDS];
+    alignas(64) atomic<uint64_t> head{0}; // فقط مصرف‌کننده جلو می‌برد
+    alignas(64) atomic<uint64_t> tail{0}; // فقط نخ صاحب صف جلو می‌برد
+    string thread_label;                  // " T<id>" که یک‌بار هنگام ثبت نخ ساخته می‌شود
+};
+
+// لاگر ناهمگام: هر نخ در صف خودش می‌نویسد و یک نخ پس‌زمینه همه صف‌ها را قالب‌بندی و یک‌جا
+// روی خروجی می‌نویسد. صف پر یعنی نویسنده عقب افتاده است؛ پیام دور ریخته و شمارش می‌شود.
+class AsyncLogger {
+private:
+    mutex registry_mutex; // فقط هنگام ثبت یک نخ جدید یا برداشتن فهرست صف‌ها
+    vector<ThreadLogBuffer*> buffers;
+    mutex drain_mutex;    // در هر لحظه فقط یک مصرف‌کننده (نخ نویسنده یا flush)
+    atomic<int> min_level{(int)LogLevel::INFO};
+    atomic<uint64_t> dropped{0};
+    uint64_t reported_dropped = 0;
+    time_t formatted_second = -1;
+    char formatted_time[16];
+
+    ThreadLogBuffer& local_buffer() {
+        thread_local ThreadLogBuffer* buffer = nullptr;
+        if (!buffer) {
+            // صف‌ها هیچ‌وقت آزاد نمی‌شوند: نخ‌های سرور تا پایان برنامه زنده‌اند
+            buffer = new ThreadLogBuffer();
+            stringstream label;
+            label << " T" << this_thread::get_id();
+            buffer->thread_label = label.str();
+            lock_guard<mutex> lock(registry_mutex);
+            buffers.push_back(buffer);
+        }
+        return *buffer;
+    }
+
+    static const char* level_tag(LogLevel level) {
+        switch (level) {
+            case LogLevel::DEBUG: return "DEBUG ";
+            case LogLevel::WARN: return "WARN ";
+            case LogLevel::ERROR: return "ERROR ";
+            default: return "";
+        }
+    }
+
+    void append_record(string& out, const LogRecord& record, const string& thread_label) {
+        if (record.time != formatted_second) {
+            struct tm tm_local;
+            localtime_r(&record.time, &tm_local);
+            strftime(formatted_time, sizeof(formatted_time), "%H:%M:%S", &tm_local);
+            formatted_second = record.time;
+        }
+        out += '[';
+        out += formatted_time;
+        out += thread_label;
+        out += "] ";
+        out += level_tag(record.level);
+        out.append(record.text, record.length);
+        if (record.truncated) out += " ...";
+        out += '\n';
+    }
+
+    // تخلیه همه صف‌ها در یک خروجی؛ تعداد رکوردهای نوشته‌شده را برمی‌گرداند
+    size_t drain() {
+        lock_guard<mutex> drain_lock(drain_mutex);
+        vector<ThreadLogBuffer*> snapshot;
+        {
+            lock_guard<mutex> lock(registry_mutex);
+            snapshot = buffers;
+        }
+
+        string out;
+        size_t written = 0;
+        for (ThreadLogBuffer* buffer : snapshot) {
+            uint64_t head = buffer->head.load(memory_order_relaxed);
+            uint64_t tail = buffer->tail.load(memory_order_acquire);
+            for (; head != tail; ++head, ++written) {
+                append_record(out, buffer->records[head & (LOG_RING_RECORDS - 1)], buffer->thread_label);
+            }
+            buffer->head.store(head, memory_order_release);
+        }
+
+        uint64_t dropped_now = dropped.load(memory_order_relaxed);
+        if (dropped_now != reported_dropped) {
+            out += "[" + string(formatted_time) + "] WARN " + to_string(dropped_now - reported_dropped) +
+                   " پیام لاگ به دلیل پر شدن صف دور ریخته شد (مجموع: " + to_string(dropped_now) + ")\n";
+            reported_dropped = dropped_now;
+        }
+
+        if (!out.empty()) {
+            lock_guard<mutex> lock(cout_mutex);
+            cout.write(out.data(), out.length());
+            cout.flush();
+        }
+        return written;
+    }
+
+public:
+    void set_level(LogLevel level) { min_level.store((int)level, memory_order_relaxed); }
+
+    bool enabled(LogLevel level) const { return (int)level >= min_level.load(memory_order_relaxed); }
+
+    uint64_t dropped_count() const { return dropped.load(memory_order_relaxed); }
+
+    void log(LogLevel level, string_view message) {
+        if (!enabled(level)) return;
+        ThreadLogBuffer& buffer = local_buffer();
+        uint64_t tail = buffer.tail.load(memory_order_relaxed);
+        if (tail - buffer.head.load(memory_order_acquire) >= LOG_RING_RECORDS) {
+            dropped.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+
+        LogRecord& record = buffer.records[tail & (LOG_RING_RECORDS - 1)];
+        size_t length = min(message.length(), LOG_RECORD_TEXT);
+        // کوتاه کردن فقط روی مرز کاراکتر UTF-8 (پیام‌ها فارسی‌اند)
+        if (length < message.length()) {
+            while (length > 0 && ((unsigned char)message[length] & 0xC0) == 0x80) --length;
+        }
+        memcpy(record.text, message.data(), length);
+        record.length = (uint16_t)length;
+        record.truncated = length < message.length();
+        record.level = level;
+        record.time = server_clock.now().now;
+        buffer.tail.store(tail + 1, memory_order_release);
+    }
+
+    void start() {
+        thread([this] {
+            while (true) {
+                if (drain() == 0) this_thread::sleep_for(chrono::milliseconds(5));
+            }
+        }).detach();
+    }
+
+    // تخلیه همزمان (مثلاً پیش از خروج برنامه)
+    void flush() { drain(); }
+};
+
+AsyncLogger logger;
+
+void log_message(LogLevel level, const string& message) {
+    logger.log(level, message);
+}
+
 void log_message(const string& message) {
-    lock_guard<mutex> lock(cout_mutex);
-    time_t now = time(0);
-    struct tm* ltm = localtime(&now);
-    cout << "[" << put_time(ltm, "%H:%M:%S") << " T" << this_thread::get_id() << "] " << message << endl;
+    logger.log(LogLevel::INFO, message);
 }
 
+// ----------------------------------------------------------------------
+// --- لاگ دسترسی دودویی (فایل mmap شده با چرخش) ---
+// ----------------------------------------------------------------------
+
+// هر درخواست یک رکورد ۳۲ بایتی با طول ثابت است (قالب در access_log_format.h). نخ‌ها خانه خود را با یک
+// fetch_add رزرو و مستقیم در فایل mmap شده می‌نویسند: نه قفل، نه قالب‌بندی متن، نه فراخوانی سیستمی.
+// با پر شدن فایل، access.bin به access.bin.1 و ... منتقل و فایل تازه ساخته می‌شود. چون نگاشت
+// MAP_SHARED است، رکوردهای نوشته‌شده حتی با کرش شدن فرایند در page cache می‌مانند و به دیسک می‌رسند.
+// خواندن: ابزار logdecode (خروجی CSV یا JSON).
+class AccessLog {
+private:
+    struct Segment {
+        int fd;
+        char* base;
+        size_t map_length;
+        uint64_t capacity;
+        atomic<uint64_t> next{0}; // خانه بعدی برای رزرو؛ می‌تواند از capacity جلو بزند
+    };
+
+    string path;
+    string route_table;
+    atomic<Segment*> current{nullptr};
+    mutex rotate_mutex;
+    // نخی که اشاره‌گر قطعه را پیش از چرخش برداشته ممکن است هنوز در آن بنویسد؛ پس قطعه کنار گذاشته
+    // فقط پس از دو چرخش بعدی unmap می‌شود
+    deque<Segment*> retired;
+
+    static uint64_t now_us() {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    // access.bin.3 -> access.bin.4، ...، access.bin -> access.bin.1 (قدیمی‌ترین حذف می‌شود)
+    void shift_files() {
+        for (int i = ACCESS_LOG_FILES - 1; i >= 0; --i) {
+            string from = i == 0 ? path : path + "." + to_string(i);
+            rename(from.c_str(), (path + "." + to_string(i + 1)).c_str());
+        }
+    }
+
+    Segment* create_segment() {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            log_message(LogLevel::ERROR, "خطا در ساخت فایل لاگ دسترسی " + path + ": " + strerror(errno));
+            return nullptr;
+        }
+        size_t map_length = ACCESS_LOG_HEADER_SIZE + ACCESS_LOG_RECORDS * sizeof(AccessLogRecord);
+        // فایل تنک: بلوک‌ها فقط با نوشته شدن رکوردها واقعاً تخصیص می‌یابند
+        if (ftruncate(fd, map_length) < 0) {
+            log_message(LogLevel::ERROR, "خطا در تعیین اندازه فایل لاگ دسترسی: " + string(strerror(errno)));
+            close(fd);
+            return nullptr;
+        }
+        void* base = mmap(nullptr, map_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+            log_message(LogLevel::ERROR, "خطا در mmap فایل لاگ دسترسی: " + string(strerror(errno)));
+            close(fd);
+            return nullptr;
+        }
+
+        AccessLogFileHeader header = {};
+        memcpy(header.magic, ACCESS_LOG_MAGIC, sizeof(header.magic));
+        header.version = ACCESS_LOG_VERSION;
+        header.record_size = sizeof(AccessLogRecord);
+        header.capacity = ACCESS_LOG_RECORDS;
+        header.created_us = now_us();
+        header.route_table_length = (uint32_t)route_table.length();
+        memcpy(base, &header, sizeof(header));
+        memcpy((char*)base + sizeof(header), route_table.data(), route_table.length());
+
+        Segment* segment = new Segment();
+        segment->fd = fd;
+        segment->base = (char*)base;
+        segment->map_length = map_length;
+        segment->capacity = ACCESS_LOG_RECORDS;
+        return segment;
+    }
+
+    void rotate(Segment* full) {
+        lock_guard<mutex> lock(rotate_mutex);
+        if (current.load(memory_order_acquire) != full) return; // نخ دیگری زودتر چرخانده است
+
+        shift_files();
+        Segment* fresh = create_segment();
+        current.store(fresh, memory_order_release); // در صورت خطا لاگ دسترسی خاموش می‌شود
+        retired.push_back(full);
+        while (retired.size() > 2) {
+            Segment* old = retired.front();
+            retired.pop_front();
+            munmap(old->base, old->map_length);
+            close(old->fd);
+            delete old;
+        }
+    }
+
+public:
+    // routes: نام مسیرها به ترتیب شناسه (شناسه = اندیس + 1)
+    bool open(const string& file_path, const vector<string>& routes) {
+        path = file_path;
+        route_table.clear();
+        for (size_t i = 0; i < routes.size(); ++i) {
+            string line = to_string(i + 1) + "\t" + routes[i] + "\n";
+            if (sizeof(AccessLogFileHeader) + route_table.length() + line.length() > ACCESS_LOG_HEADER_SIZE) {
+                log_message(LogLevel::WARN, "جدول مسیرهای لاگ دسترسی در سرآیند جا نشد؛ از شناسه " + to_string(i + 1) + " به بعد بی‌نام است.");
+                break;
+            }
+            route_table += line;
+        }
+
+        shift_files(); // لاگ اجرای قبلی بازنویسی نمی‌شود
+        Segment* segment = create_segment();
+        current.store(segment, memory_order_release);
+        return segment != nullptr;
+    }
+
+    bool enabled() const { return current.load(memory_order_relaxed) != nullptr; }
+
+    // method: مقدار HttpMethod (اندیس در HTTP_METHOD_NAMES)
+    void record(uint64_t timestamp_us, uint8_t method, uint8_t route_id, int status,
+                uint64_t bytes_sent, uint64_t bytes_received, uint64_t latency_us) {
+        while (true) {
+            Segment* segment = current.load(memory_order_acquire);
+            if (!segment) return;
+            uint64_t slot = segment->next.fetch_add(1, memory_order_relaxed);
+            if (slot >= segment->capacity) {
+                rotate(segment);
+                continue;
+            }
+
+            AccessLogRecord* entry = (AccessLogRecord*)(segment->base + ACCESS_LOG_HEADER_SIZE) + slot;
+            entry->bytes_sent = bytes_sent;
+            entry->latency_us = (uint32_t)min<uint64_t>(latency_us, UINT32_MAX);
+            entry->bytes_received = (uint32_t)min<uint64_t>(bytes_received, UINT32_MAX);
+            entry->status = (uint16_t)status;
+            entry->method = method;
+            entry->route_id = route_id;
+            entry->reserved = 0;
+            // timestamp آخر نوشته می‌شود: رکورد با timestamp صفر از دید خواننده هنوز نوشته نشده است
+            __atomic_store_n(&entry->timestamp_us, timestamp_us, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+
+    static uint64_t timestamp_now() { return now_us(); }
+};
+
+AccessLog access_log;
+
+// ----------------------------------------------------------------------
+// --- متریک‌های زمان اجرا (هیستوگرام تأخیر هر مسیر و شمارنده‌ها) ---
+// ----------------------------------------------------------------------
+
+// شمارنده ۶۴ بیتی تقسیم‌شده: هر نخ خانه خودش را روی یک خط کش جداگانه افزایش می‌دهد و خواندن
+// مجموع خانه‌هاست؛ پس افزایش هم‌زمان از چند هسته خط کش مشترکی را بین هسته‌ها جابه‌جا نمی‌کند.
+// مقدار خوانده‌شده لحظه‌ای دقیق نیست (افزایش‌های در حال انجام ممکن است دیده نشوند) ولی هیچ افزایشی گم نمی‌شود.
+// کاهش (sub) برای gaugeها با حساب پیمانه‌ای درست جمع می‌شود، حتی اگر نخ کاهنده با افزاینده فرق کند.
+class ShardedCounter {
+private:
+    struct alignas(64) Shard {
+        atomic<uint64_t> value{0};
+    };
+    Shard shards[COUNTER_SHARDS];
+
+    // اندیس خانه هر نخ یک‌بار گرفته می‌شود و بین همه شمارنده‌ها مشترک است
+    static size_t shard_index() {
+        static atomic<size_t> next_thread{0};
+        thread_local size_t index = next_thread.fetch_add(1, memory_order_relaxed) & (COUNTER_SHARDS - 1);
+        return index;
+    }
+
+public:
+    void add(uint64_t delta = 1) { shards[shard_index()].value.fetch_add(delta, memory_order_relaxed); }
+    void sub(uint64_t delta = 1) { shards[shard_index()].value.fetch_sub(delta, memory_order_relaxed); }
+
+    uint64_t value() const {
+        uint64_t total = 0;
+        for (const Shard& shard : shards) total += shard.value.load(memory_order_relaxed);
+        return total;
+    }
+};
+
+ShardedCounter counter; // شمارنده بازدید /count (تست Multi-thread)
+
+// هیستوگرام log-linear به سبک HDR برای تأخیر بر حسب میکروثانیه: مقدارهای کمتر از ۶۴ دقیق و هر بازه
+// توان ۲ بالاتر از آن ۳۲ زیربازه دارد (خطای نسبی کمتر از ۳٪) تا سقف uint32 (حدود ۷۱ دقیقه).
+// هر نمونه فقط متعلق به یک نخ نویسنده است؛ پس افزایش با load/store معمولی انجام می‌شود (بدون lock یا RMW)
+// و خواننده /metrics با load نسبی (relaxed) جمع می‌زند.
+struct LatencyHistogram {
+    static const int SUB_BUCKET_BITS = 5;
+    static const size_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const size_t BUCKETS = (32 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    atomic<uint64_t> counts[BUCKETS];
+    atomic<uint64_t> total;
+    atomic<uint64_t> sum_us;
+
+    static size_t bucket_for(uint32_t value) {
+        if (value < 2 * SUB_BUCKETS) return value;
+        int shift = (31 - __builtin_clz(value)) - SUB_BUCKET_BITS;
+        return (shift + 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS);
+    }
+
+    // بزرگ‌ترین مقدار هم‌ارز خانه (مثل HDR؛ صدک‌ها هرگز کمتر از مقدار واقعی گزارش نمی‌شوند)
+    static uint64_t bucket_upper(size_t index) {
+        if (index < 2 * SUB_BUCKETS) return index;
+        size_t shift = index / SUB_BUCKETS - 1;
+        uint64_t sub = index % SUB_BUCKETS + SUB_BUCKETS;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    void record(uint32_t value_us) {
+        atomic<uint64_t>& bucket = counts[bucket_for(value_us)];
+        bucket.store(bucket.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        sum_us.store(sum_us.load(memory_order_relaxed) + value_us, memory_order_relaxed);
+        total.store(total.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+};
+
+// دسته کد وضعیت: 0 برای مقدار نامعتبر، سپس 1xx تا 5xx
+const size_t STATUS_CLASSES = 6;
+const char* const STATUS_CLASS_NAMES[STATUS_CLASSES] = {"other", "1xx", "2xx", "3xx", "4xx", "5xx"};
+const size_t ROUTE_IDS = 256; // route_id یک بایت است؛ 0 یعنی بدون مسیر منطبق
+
+// هیستوگرام‌های یک نخ؛ هر جفت (مسیر، دسته وضعیت) با اولین نمونه ساخته می‌شود
+struct ThreadMetrics {
+    atomic<LatencyHistogram*> histograms[ROUTE_IDS * STATUS_CLASSES] = {};
+};
+
+class Metrics {
+private:
+    mutex registry_mutex; // فقط هنگام ثبت نخ جدید یا ساخت خروجی
+    vector<ThreadMetrics*> threads;
+    vector<string> route_names;
+
+    ShardedCounter bytes_received;
+    ShardedCounter bytes_sent;
+    ShardedCounter connections_accepted;
+    ShardedCounter connections_open;
+    ShardedCounter db_lock_acquisitions;
+    ShardedCounter db_lock_wait_us;
+    ShardedCounter db_statement_prepares;
+    ShardedCounter connection_timeouts[4]; // هم‌ترتیب با ConnectionPhase
+    ShardedCounter connections_rejected[3]; // هم‌ترتیب با AdmissionVerdict
+
+    ThreadMetrics& local_metrics() {
+        thread_local ThreadMetrics* local = nullptr;
+        if (!local) {
+            // مثل صف‌های لاگ هیچ‌وقت آزاد نمی‌شوند: نخ‌های سرور تا پایان برنامه زنده‌اند
+            local = new ThreadMetrics();
+            lock_guard<mutex> lock(registry_mutex);
+            threads.push_back(local);
+        }
+        return *local;
+    }
+
+    static size_t status_class(int status) {
+        return status >= 100 && status < 600 ? status / 100 : 0;
+    }
+
+    // کوچک‌ترین مقداری که دست‌کم سهم q از نمونه‌ها از آن کمتر یا مساوی‌اند
+    static uint64_t quantile(const vector<uint64_t>& counts, uint64_t total, double q) {
+        uint64_t rank = max<uint64_t>(1, (uint64_t)ceil(q * total));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen >= rank) return LatencyHistogram::bucket_upper(i);
+        }
+        return LatencyHistogram::bucket_upper(counts.size() - 1);
+    }
+
+    static string escape_label(const string& value) {
+        string out;
+        for (char c : value) {
+            if (c == '\\' || c == '"') out += '\\';
+            if (c == '\n') { out += "\\n"; continue; }
+            out += c;
+        }
+        return out;
+    }
+
+    static string seconds(uint64_t microseconds) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.6f", microseconds / 1e6);
+        return buffer;
+    }
+
+public:
+    // پیش از پذیرش اولین اتصال صدا زده می‌شود (شناسه = اندیس + 1)
+    void set_route_names(const vector<string>& names) { route_names = names; }
+
+    void observe_request(uint8_t route_id, int status, uint64_t latency_us, uint64_t received, uint64_t sent) {
+        ThreadMetrics& local = local_metrics();
+        atomic<LatencyHistogram*>& slot = local.histograms[route_id * STATUS_CLASSES + status_class(status)];
+        LatencyHistogram* histogram = slot.load(memory_order_relaxed);
+        if (!histogram) {
+            histogram = new LatencyHistogram(); // مقداردهی صفر
+            slot.store(histogram, memory_order_release);
+        }
+        histogram->record((uint32_t)min<uint64_t>(latency_us, UINT32_MAX));
+        bytes_received.add(received);
+        bytes_sent.add(sent);
+    }
+
+    void connection_opened() {
+        connections_accepted.add();
+        connections_open.add();
+    }
+
+    void connection_closed() { connections_open.sub(); }
+
+    // phase: اندیس ConnectionPhase (header، body، keepalive)
+    void connection_timed_out(size_t phase) { connection_timeouts[phase].add(); }
+
+    // reason: اندیس AdmissionVerdict (max_connections، per_ip، overload)
+    void connection_rejected(size_t reason) { connections_rejected[reason].add(); }
+
+    void record_db_lock_wait(uint64_t wait_us) {
+        db_lock_acquisitions.add();
+        if (wait_us > 0) db_lock_wait_us.add(wait_us);
+    }
+
+    // هر کامپایل SQL (miss کش statement)؛ در حالت پایدار نباید افزایش یابد
+    void record_db_statement_prepare() { db_statement_prepares.add(); }
+
+    // خروجی به قالب متنی Prometheus (نسخه 0.0.4). تأخیرها به صورت summary با صدک‌های 0.5/0.99/0.999
+    // گزارش می‌شوند؛ نرخ پذیرش اتصال با rate() روی شمارنده accepted به دست می‌آید.
+    string render_prometheus() {
+        vector<ThreadMetrics*> snapshot;
+        {
+            lock_guard<mutex> lock(registry_mutex);
+            snapshot = threads;
+        }
+
+        string out;
+        out += "# HELP webserver_request_duration_seconds Time from parsed request headers to the last response byte.\n"
+               "# TYPE webserver_request_duration_seconds summary\n";
+        vector<uint64_t> merged(LatencyHistogram::BUCKETS);
+        for (size_t slot = 0; slot < ROUTE_IDS * STATUS_CLASSES; ++slot) {
+            fill(merged.begin(), merged.end(), 0);
+            uint64_t total = 0, sum_us = 0;
+            for (ThreadMetrics* local : snapshot) {
+                const LatencyHistogram* histogram = local->histograms[slot].load(memory_order_acquire);
+                if (!histogram) continue;
+                for (size_t i = 0; i < LatencyHistogram::BUCKETS; ++i) merged[i] += histogram->counts[i].load(memory_order_relaxed);
+                sum_us += histogram->sum_us.load(memory_order_relaxed);
+            }
+            for (uint64_t count : merged) total += count; // از روی خانه‌ها تا صدک‌ها با count هم‌خوان باشند
+            if (total == 0) continue;
+
+            size_t route_id = slot / STATUS_CLASSES;
+            string route = route_id == 0 ? "unmatched"
+                         : route_id <= route_names.size() ? route_names[route_id - 1] : "route_" + to_string(route_id);
+            string labels = "route=\"" + escape_label(route) + "\",status=\"" + STATUS_CLASS_NAMES[slot % STATUS_CLASSES] + "\"";
+            for (double q : {0.5, 0.99, 0.999}) {
+                char q_text[16];
+                snprintf(q_text, sizeof(q_text), "%g", q);
+                out += "webserver_request_duration_seconds{" + labels + ",quantile=\"" + q_text + "\"} " +
+                       seconds(quantile(merged, total, q)) + "\n";
+            }
+            out += "webserver_request_duration_seconds_sum{" + labels + "} " + seconds(sum_us) + "\n";
+            out += "webserver_request_duration_seconds_count{" + labels + "} " + to_string(total) + "\n";
+        }
+
+        auto metric = [&out](const char* name, const char* type, const char* help, const string& value) {
+            out += string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n" + name + " " + value + "\n";
+        };
+        metric("webserver_received_bytes_total", "counter", "Request bytes (headers and body) received.",
+               to_string(bytes_received.value()));
+        metric("webserver_sent_bytes_total", "counter", "Response bytes (headers and body) sent.",
+               to_string(bytes_sent.value()));
+        metric("webserver_open_connections", "gauge", "Client connections currently open.",
+               to_string((int64_t)connections_open.value()));
+        metric("webserver_accepted_connections_total", "counter", "Client connections accepted.",
+               to_string(connections_accepted.value()));
+        out += "# HELP webserver_connection_timeouts_total Connections closed by the timer wheel, by the phase they were waiting in.\n"
+               "# TYPE webserver_connection_timeouts_total counter\n";
+        const char* const phase_names[] = {"header", "body", "keepalive", "write"};
+        for (size_t phase = 0; phase < 4; ++phase) {
+            out += string("webserver_connection_timeouts_total{phase=\"") + phase_names[phase] + "\"} " +
+                   to_string(connection_timeouts[phase].value()) + "\n";
+        }
+        out += "# HELP webserver_rejected_connections_total Connections answered with 503 at accept time, by reason.\n"
+               "# TYPE webserver_rejected_connections_total counter\n";
+        const char* const reject_reasons[] = {"max_connections", "per_ip", "overload"};
+        for (size_t reason = 0; reason < 3; ++reason) {
+            out += string("webserver_rejected_connections_total{reason=\"") + reject_reasons[reason] + "\"} " +
+                   to_string(connections_rejected[reason].value()) + "\n";
+        }
+        metric("webserver_db_lock_acquisitions_total", "counter", "Acquisitions of a SQLite connection (writer lock or reader pool).",
+               to_string(db_lock_acquisitions.value()));
+        metric("webserver_db_lock_wait_seconds_total", "counter", "Time spent waiting for a SQLite connection (writer lock or reader pool).",
+               seconds(db_lock_wait_us.value()));
+        metric("webserver_db_statement_prepares_total", "counter", "SQL statements compiled (prepared statement cache misses).",
+               to_string(db_statement_prepares.value()));
+        metric("webserver_log_dropped_total", "counter", "Log messages dropped because a thread log ring was full.",
+               to_string(logger.dropped_count()));
+        metric("webserver_count_visits_total", "counter", "Visits served by GET /count.", to_string(counter.value()));
+        return out;
+    }
+};
+
+Metrics metrics;
+
+// ----------------------------------------------------------------------
+// --- کنترل پذیرش اتصال (سقف اتصال‌ها، سقف هر IP و رد کردن در اضافه‌بار) ---
+// ----------------------------------------------------------------------
+
+// دلیل رد اتصال؛ هم‌ترتیب با برچسب‌های webserver_rejected_connections_total
+enum class AdmissionVerdict : uint8_t { MAX_CONNECTIONS, PER_IP, OVERLOAD, ADMIT };
+
+// تصمیم پذیرش درست پس از accept گرفته می‌شود: اتصال ردشده یک پاسخ 503 از پیش ساخته‌شده می‌گیرد و
+// بسته می‌شود، پیش از آنکه حافظه‌ای برای Connection تخصیص یابد یا کاری به استخر برسد.
+// شمارش هر IP در جدول‌های تقسیم‌شده (هر کدام با قفل خودش) نگه داشته می‌شود تا حلقه‌های پذیرش
+// (در حالت reuseport) روی یک قفل رقابت نکنند.
+class AdmissionControl {
+private:
+    static const size_t IP_SHARDS = 16;
+
+    struct IpShard {
+        mutex shard_mutex;
+        unordered_map<uint32_t, uint32_t> counts;
+    };
+
+    atomic<int64_t> open_connections{0};
+    IpShard ip_shards[IP_SHARDS];
+    string overload_response; // بدون خط وضعیت و Date؛ آن دو هنگام ارسال کنار آن قرار می‌گیرند
+
+    IpShard& shard_for(uint32_t ip) { return ip_shards[(ip * 2654435761u) >> 28]; }
+
+public:
+    // پس از خواندن تنظیمات و پیش از پذیرش اولین اتصال
+    void init() {
+        static const string body = "<h1>503</h1><p>سرور در حال حاضر بیش از حد مشغول است؛ لطفاً کمی بعد دوباره تلاش کنید.</p>";
+        overload_response = "Content-Type: text/html; charset=utf-8\r\n"
+                            "Content-Length: " + to_string(body.length()) + "\r\n"
+                            "Retry-After: " + to_string(server_config.retry_after_seconds) + "\r\n"
+                            "Connection: close\r\n\r\n" + body;
+    }
+
+    // ip به ترتیب بایت شبکه؛ در صورت ADMIT فراخواننده باید در پایان release را صدا بزند
+    AdmissionVerdict try_admit(uint32_t ip, size_t queue_depth) {
+        if (server_config.shed_queue_depth > 0 && queue_depth >= (size_t)server_config.shed_queue_depth) {
+            return AdmissionVerdict::OVERLOAD;
+        }
+        int64_t open_before = open_connections.fetch_add(1, memory_order_relaxed);
+        if (server_config.max_connections > 0 && open_before >= server_config.max_connections) {
+            open_connections.fetch_sub(1, memory_order_relaxed);
+            return AdmissionVerdict::MAX_CONNECTIONS;
+        }
+        if (server_config.max_connections_per_ip > 0) {
+            IpShard& shard = shard_for(ip);
+            lock_guard<mutex> lock(shard.shard_mutex);
+            uint32_t& count = shard.counts[ip];
+            if (count >= (uint32_t)server_config.max_connections_per_ip) {
+                open_connections.fetch_sub(1, memory_order_relaxed);
+                return AdmissionVerdict::PER_IP;
+            }
+            ++count;
+        }
+        return AdmissionVerdict::ADMIT;
+    }
+
+    void release(uint32_t ip) {
+        open_connections.fetch_sub(1, memory_order_relaxed);
+        if (server_config.max_connections_per_ip > 0) {
+            IpShard& shard = shard_for(ip);
+            lock_guard<mutex> lock(shard.shard_mutex);
+            auto it = shard.counts.find(ip);
+            if (it != shard.counts.end() && --it->second == 0) shard.counts.erase(it);
+        }
+    }
+
+    // پاسخ 503 با Retry-After روی سوکت تازه پذیرفته‌شده و بستن آن؛ ارسال بدون انتظار (best effort).
+    // داده‌های خوانده‌نشده پیش از close دور ریخته می‌شوند تا کرنل به جای FIN، RST نفرستد و پاسخ گم نشود.
+    void reject(int client_socket, AdmissionVerdict verdict) {
+        static const char STATUS[] = "HTTP/1.1 503 Service Unavailable\r\n";
+        const ClockSnapshot& clock = server_clock.now();
+        struct iovec iov[3] = {
+            {const_cast<char*>(STATUS), sizeof(STATUS) - 1},
+            {const_cast<char*>(clock.date_header), clock.date_header_length},
+            {const_cast<char*>(overload_response.data()), overload_response.length()},
+        };
+        struct msghdr message = {};
+        message.msg_iov = iov;
+        message.msg_iovlen = 3;
+        if (sendmsg(client_socket, &message, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+            // کلاینت رفته یا بافر ارسال پر است؛ در هر حال اتصال بسته می‌شود
+        }
+        shutdown(client_socket, SHUT_WR);
+        char discard[4096];
+        for (int i = 0; i < 4 && recv(client_socket, discard, sizeof(discard), MSG_DONTWAIT) > 0; ++i) {}
+        close(client_socket);
+        metrics.connection_rejected((size_t)verdict);
+    }
+};
+
+AdmissionControl admission;
+
 // ----------------------------------------------------------------------
 // --- ۱. ابزارهای JSON ---
 // ----------------------------------------------------------------------
@@ -82,6 +883,16 @@ public:
         return json;
     }
     
+    // افزودن مقدار به صورت رشته JSON (با نقل قول‌ها) به انتهای out
+    static void append_string(string& out, string_view value) {
+        out += '"';
+        for (char c : value) {
+            if (c == '"' || c == '\\') out += '\\';
+            out += c;
+        }
+        out += '"';
+    }
+
     static string trim(const string& str) {
         size_t first = str.find_first_not_of(" \t\n\r");
         if (string::npos == first) return "";
@@ -173,104 +984,327 @@ public:
 // --- ۱.۵. کلاس DatabaseManager (SQLite3 - با Prepared Statements امن) ---
 // ----------------------------------------------------------------------
 
+// مقدار پارامتر کوئری با نوع SQLite. متن و blob کپی نمی‌شوند (SQLITE_STATIC)، پس حافظه آن‌ها باید
+// تا پایان فراخوانی DatabaseManager زنده بماند.
+struct SqlParam {
+    enum class Type : uint8_t { NULL_VALUE, INT64, TEXT, BLOB };
+    Type type;
+    int64_t integer = 0;
+    const void* data = nullptr;
+    int length = 0;
+
+    SqlParam() : type(Type::NULL_VALUE) {}
+    SqlParam(int64_t value) : type(Type::INT64), integer(value) {}
+    SqlParam(string_view text) : type(Type::TEXT), data(text.data()), length((int)text.length()) {}
+    SqlParam(const string& text) : SqlParam(string_view(text)) {}
+    SqlParam(const char* text) : SqlParam(string_view(text)) {}
+
+    static SqlParam null() { return SqlParam(); }
+    static SqlParam blob(const void* bytes, size_t size) {
+        SqlParam param;
+        param.type = Type::BLOB;
+        param.data = bytes;
+        param.length = (int)size;
+        return param;
+    }
+};
+
+// کش LRU از statementهای آماده یک اتصال، با کلید متن SQL. هر اتصال فقط در اختیار یک نخ است
+// (قفل نویسنده یا اجاره خواننده)، پس کش قفل جداگانه ندارد. statement پس از استفاده با
+// sqlite3_reset و sqlite3_clear_bindings برای فراخوانی بعدی آماده می‌شود.
+class StatementCache {
+private:
+    struct Entry {
+        string sql;
+        sqlite3_stmt* stmt;
+    };
+
+    list<Entry> lru; // ابتدای لیست: جدیدترین استفاده
+    unordered_map<string_view, list<Entry>::iterator> index; // کلید به sql همان Entry اشاره می‌کند
+    size_t capacity;
+
+public:
+    explicit StatementCache(size_t max_statements) : capacity(max_statements) {}
+    ~StatementCache() { clear(); }
+    StatementCache(const StatementCache&) = delete;
+    StatementCache& operator=(const StatementCache&) = delete;
+
+    // statement آماده برای sql؛ در صورت نبود یک‌بار کامپایل می‌شود. nullptr یعنی خطای کامپایل
+    sqlite3_stmt* get(sqlite3* db, const string& sql) {
+        auto it = index.find(sql);
+        if (it != index.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            return it->second->stmt;
+        }
+
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v3(db, sql.c_str(), (int)sql.length() + 1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr) != SQLITE_OK) {
+            log_message(LogLevel::ERROR, "خطا در آماده‌سازی کوئری: " + string(sqlite3_errmsg(db)) + " | SQL: " + sql);
+            sqlite3_finalize(stmt);
+            return nullptr;
+        }
+        metrics.record_db_statement_prepare();
+        lru.push_front(Entry{sql, stmt});
+        index[lru.front().sql] = lru.begin();
+        if (lru.size() > capacity) {
+            index.erase(lru.back().sql);
+            sqlite3_finalize(lru.back().stmt);
+            lru.pop_back();
+        }
+        return stmt;
+    }
+
+    void clear() {
+        for (Entry& entry : lru) {
+            sqlite3_finalize(entry.stmt);
+        }
+        lru.clear();
+        index.clear();
+    }
+};
+
+// یک اتصال SQLite همراه با کش statementهای آن
+struct DbConnection {
+    sqlite3* db;
+    StatementCache statements;
+
+    explicit DbConnection(sqlite3* handle) : db(handle), statements(DB_STATEMENT_CACHE_SIZE) {}
+    ~DbConnection() {
+        statements.clear(); // statementها باید پیش از بستن اتصال finalize شوند
+        sqlite3_close(db);
+    }
+    DbConnection(const DbConnection&) = delete;
+    DbConnection& operator=(const DbConnection&) = delete;
+};
+
+// اتصال‌های SQLite در حالت WAL: یک اتصال نویسنده (SQLite در هر لحظه فقط یک نویسنده می‌پذیرد) و
+// چند اتصال فقط‌خواندنی که هم با یکدیگر و هم با نویسنده موازی اجرا می‌شوند. هر اتصال در هر لحظه
+// فقط در اختیار یک نخ است (SQLITE_OPEN_NOMUTEX) و کش صفحات خصوصی دارد؛ حالت shared-cache عمداً
+// استفاده نمی‌شود چون اتصال‌ها را روی قفل جدول‌ها سریالی می‌کند. اشتراک صفحات بین اتصال‌ها از طریق
+// mmap و page cache سیستم‌عامل انجام می‌شود.
 class DatabaseManager {
 private:
-    sqlite3* db_ptr;
+    unique_ptr<DbConnection> writer;
+    timed_mutex writer_mutex;
+    vector<unique_ptr<DbConnection>> readers; // همه اتصال‌های خواندنی (مالک)
+    vector<DbConnection*> idle_readers;       // اتصال‌های خواندنی آزاد
+    mutex readers_mutex;
+    condition_variable readers_cv;
+
+    static uint64_t elapsed_us(chrono::steady_clock::time_point started) {
+        return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started).count();
+    }
 
-    // تابع کال‌بک برای واکشی نتایج
-    static int callback(void* data, int argc, char** argv, char** azColName) {
-        auto* result_vec = static_cast<vector<map<string, string>>*>(data);
-        map<string, string> row;
-        for (int i = 0; i < argc; i++) {
-            row[azColName[i]] = argv[i] ? argv[i] : ""; // NULL به رشته خالی تبدیل می‌شود
+    // قفل اتصال نویسنده همراه با اندازه‌گیری زمان انتظار برای /metrics؛ در حالت بدون رقابت ساعت
+    // اصلاً خوانده نمی‌شود. با timeout_ms نامنفی ممکن است قفل گرفته نشود (owns_lock() == false)
+    unique_lock<timed_mutex> lock_writer(int timeout_ms = -1) {
+        unique_lock<timed_mutex> lock(writer_mutex, try_to_lock);
+        if (lock.owns_lock()) {
+            metrics.record_db_lock_wait(0);
+            return lock;
         }
-        result_vec->push_back(row);
-        return 0;
+        auto started = chrono::steady_clock::now();
+        if (timeout_ms < 0) lock.lock();
+        else lock.try_lock_for(chrono::milliseconds(timeout_ms));
+        metrics.record_db_lock_wait(elapsed_us(started));
+        return lock;
     }
-    
-    // تابع کمکی عمومی برای کوئری‌های SELECT (که نیاز به نتایج دارند)
-    bool execute_select(const string& sql, vector<map<string, string>>& results) {
-        char* err_msg = nullptr;
-        results.clear();
 
-        // قفل کردن دسترسی به شیء اتصال (برای ایمنی Thread)
-        lock_guard<mutex> lock(db_connection_mutex); 
+    // گرفتن یک اتصال خواندنی آزاد (در صورت نیاز با انتظار تا db_busy_timeout_ms)؛ Cursor در پایان آن را
+    // برمی‌گرداند. nullptr یعنی همه اتصال‌ها در این مدت مشغول ماندند و فراخواننده باید 503 بدهد
+    DbConnection* acquire_reader() {
+        unique_lock<mutex> lock(readers_mutex);
+        if (!idle_readers.empty()) {
+            metrics.record_db_lock_wait(0);
+        } else {
+            auto started = chrono::steady_clock::now();
+            bool available = readers_cv.wait_for(lock, chrono::milliseconds(server_config.db_busy_timeout_ms),
+                                                 [this] { return !idle_readers.empty(); });
+            metrics.record_db_lock_wait(elapsed_us(started));
+            if (!available) return nullptr;
+        }
+        DbConnection* reader = idle_readers.back();
+        idle_readers.pop_back();
+        return reader;
+    }
 
-        int rc = sqlite3_exec(db_ptr, sql.c_str(), callback, &results, &err_msg);
-        
-        if (rc != SQLITE_OK) {
-            log_message("خطا در کوئری SELECT: " + string(err_msg) + " | SQL: " + sql);
+    void release_reader(DbConnection* reader) {
+        {
+            lock_guard<mutex> lock(readers_mutex);
+            idle_readers.push_back(reader);
+        }
+        readers_cv.notify_one();
+    }
+
+    // statement پس از استفاده (موفق یا ناموفق) برای اجرای بعدی از کش بازنشانی می‌شود
+    struct StatementReset {
+        sqlite3_stmt* stmt;
+        ~StatementReset() {
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+        }
+    };
+
+    static bool run_pragma(sqlite3* db, const string& pragma) {
+        char* err_msg = nullptr;
+        if (sqlite3_exec(db, pragma.c_str(), nullptr, nullptr, &err_msg) != SQLITE_OK) {
+            log_message(LogLevel::ERROR, "خطا در اجرای " + pragma + ": " + string(err_msg ? err_msg : "?"));
             sqlite3_free(err_msg);
             return false;
         }
         return true;
     }
 
-public:
-    DatabaseManager() : db_ptr(nullptr) {}
-    ~DatabaseManager() {
-        if (db_ptr) {
-            sqlite3_close(db_ptr);
+    // باز کردن یک اتصال و تنظیمات مشترک: busy timeout (انتظار به جای SQLITE_BUSY فوری)،
+    // mmap برای خواندن صفحات بدون کپی و synchronous=NORMAL که در WAL فقط در checkpoint، fsync می‌کند
+    static unique_ptr<DbConnection> open_connection(const string& db_path, bool writable) {
+        sqlite3* db = nullptr;
+        int flags = SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_PRIVATECACHE |
+                    (writable ? SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE : SQLITE_OPEN_READONLY);
+        if (sqlite3_open_v2(db_path.c_str(), &db, flags, nullptr) != SQLITE_OK) {
+            log_message(LogLevel::ERROR, "خطا در باز کردن دیتابیس: " + string(db ? sqlite3_errmsg(db) : "out of memory"));
+            sqlite3_close(db);
+            return nullptr;
         }
+        auto connection = make_unique<DbConnection>(db);
+        sqlite3_busy_timeout(db, server_config.db_busy_timeout_ms);
+        bool ok = (!writable || run_pragma(db, "PRAGMA journal_mode=WAL;")) &&
+                  run_pragma(db, "PRAGMA synchronous=NORMAL;") &&
+                  run_pragma(db, "PRAGMA mmap_size=" + to_string(DB_MMAP_SIZE) + ";");
+        return ok ? move(connection) : nullptr;
     }
 
-    bool open(const string& db_path) {
-        // باز کردن دیتابیس در حالت Serialized (امن برای Multi-Thread)
-        if (sqlite3_open(db_path.c_str(), &db_ptr) != SQLITE_OK) {
-            log_message("خطا در باز کردن دیتابیس: " + string(sqlite3_errmsg(db_ptr)));
-            db_ptr = nullptr;
-            return false;
+    // اتصال پارامترها (Bind) به ترتیب؛ پارامترها در SQLite از ۱ شروع می‌شوند
+    static bool bind_params(sqlite3* db, sqlite3_stmt* stmt, const vector<SqlParam>& params) {
+        for (size_t i = 0; i < params.size(); ++i) {
+            const SqlParam& param = params[i];
+            int index = (int)i + 1;
+            int rc = SQLITE_OK;
+            switch (param.type) {
+                case SqlParam::Type::NULL_VALUE: rc = sqlite3_bind_null(stmt, index); break;
+                case SqlParam::Type::INT64: rc = sqlite3_bind_int64(stmt, index, param.integer); break;
+                case SqlParam::Type::TEXT: rc = sqlite3_bind_text(stmt, index, (const char*)param.data, param.length, SQLITE_STATIC); break;
+                case SqlParam::Type::BLOB: rc = sqlite3_bind_blob(stmt, index, param.data, param.length, SQLITE_STATIC); break;
+            }
+            if (rc != SQLITE_OK) {
+                log_message(LogLevel::ERROR, "خطا در اتصال پارامتر " + to_string(index) + ": " + string(sqlite3_errmsg(db)));
+                return false;
+            }
         }
-        log_message("دیتابیس SQLite3 با موفقیت باز شد.");
         return true;
     }
 
-    // متد اصلی برای اجرای INSERT, UPDATE, DELETE (استفاده از Prepared Statements)
-    bool prepare_and_execute(const string& sql, const vector<string>& params) {
-        sqlite3_stmt *stmt;
-        lock_guard<mutex> lock(db_connection_mutex);
+public:
+    // کرسر جریانی روی نتیجه یک SELECT: هر next() یک sqlite3_step است و هیچ سطری در حافظه جمع نمی‌شود.
+    // تا نابودی کرسر یک اتصال خواندنی (یا در نبود آن، قفل نویسنده) و تراکنش خواندن WAL در اختیار آن
+    // است، پس نباید در طول I/O شبکه زنده بماند. مقادیر text() فقط تا next() بعدی معتبرند.
+    class Cursor {
+    private:
+        DatabaseManager& owner;
+        DbConnection* connection;
+        unique_lock<timed_mutex> writer_lock; // فقط وقتی اتصال خواندنی وجود ندارد
+        sqlite3_stmt* stmt = nullptr;
+        bool failed = false;
+        bool no_connection = false;
 
-        // ۱. آماده‌سازی (Prepare)
-        if (sqlite3_prepare_v2(db_ptr, sql.c_str(), -1, &stmt, 0) != SQLITE_OK) {
-            log_message("خطا در آماده‌سازی کوئری: " + string(sqlite3_errmsg(db_ptr)) + " | SQL: " + sql);
-            return false;
+    public:
+        Cursor(DatabaseManager& manager, const string& sql, const vector<SqlParam>& params) : owner(manager) {
+            if (manager.readers.empty()) {
+                writer_lock = manager.lock_writer(server_config.db_busy_timeout_ms);
+                connection = writer_lock.owns_lock() ? manager.writer.get() : nullptr;
+            } else {
+                connection = manager.acquire_reader();
+            }
+            if (!connection) {
+                log_message(LogLevel::WARN, "اتصال آزاد دیتابیس در مهلت " + to_string(server_config.db_busy_timeout_ms) + " میلی‌ثانیه پیدا نشد.");
+                failed = no_connection = true;
+                return;
+            }
+            stmt = connection->statements.get(connection->db, sql);
+            failed = !stmt || !bind_params(connection->db, stmt, params);
+        }
+        ~Cursor() {
+            if (stmt) {
+                sqlite3_reset(stmt);
+                sqlite3_clear_bindings(stmt);
+            }
+            if (connection && !writer_lock.owns_lock()) owner.release_reader(connection);
         }
+        Cursor(const Cursor&) = delete;
+        Cursor& operator=(const Cursor&) = delete;
 
-        // ۲. اتصال پارامترها (Bind) - پارامترها از ۱ شروع می‌شوند.
-        for (size_t i = 0; i < params.size(); ++i) {
-            if (sqlite3_bind_text(stmt, (int)i + 1, params[i].c_str(), (int)params[i].length(), SQLITE_STATIC) != SQLITE_OK) {
-                log_message("خطا در اتصال پارامتر " + to_string(i+1) + ": " + string(sqlite3_errmsg(db_ptr)));
-                sqlite3_finalize(stmt);
-                return false;
+        // false در پایان نتیجه یا خطا؛ ok() این دو را از هم جدا می‌کند
+        bool next() {
+            if (failed) return false;
+            int rc = sqlite3_step(stmt);
+            if (rc == SQLITE_ROW) return true;
+            if (rc != SQLITE_DONE) {
+                log_message(LogLevel::ERROR, "خطا در کوئری SELECT: " + string(sqlite3_errmsg(connection->db)) +
+                                             " | SQL: " + sqlite3_sql(stmt));
+                failed = true;
             }
+            return false;
         }
 
-        // ۳. اجرا (Step)
-        int rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt); // پاکسازی منابع
+        bool ok() const { return !failed; }
+        // همه اتصال‌ها تا پایان مهلت مشغول بودند (خطای موقت؛ 503 به جای 500)
+        bool unavailable() const { return no_connection; }
+        size_t column_count() const { return stmt ? sqlite3_column_count(stmt) : 0; }
+        const char* column_name(size_t column) const { return sqlite3_column_name(stmt, (int)column); }
+        int type(size_t column) const { return sqlite3_column_type(stmt, (int)column); }
+        bool is_null(size_t column) const { return type(column) == SQLITE_NULL; }
+        int64_t integer(size_t column) const { return sqlite3_column_int64(stmt, (int)column); }
+        double real(size_t column) const { return sqlite3_column_double(stmt, (int)column); }
 
-        if (rc != SQLITE_DONE) { // SQLITE_DONE برای INSERT, UPDATE, DELETE موفق است
-            log_message("خطا در اجرای کوئری: " + string(sqlite3_errmsg(db_ptr)));
-            return false;
+        // متن خانه (برای NULL خالی)
+        string_view text(size_t column) const {
+            const unsigned char* value = sqlite3_column_text(stmt, (int)column);
+            return value ? string_view((const char*)value, sqlite3_column_bytes(stmt, (int)column)) : string_view();
+        }
+    };
+
+    // reader_count: تعداد اتصال‌های فقط‌خواندنی؛ 0 یعنی خواندن‌ها هم از اتصال نویسنده (با قفل آن)
+    bool open(const string& db_path, int reader_count) {
+        writer = open_connection(db_path, true);
+        if (!writer) return false;
+        for (int i = 0; i < reader_count; ++i) {
+            unique_ptr<DbConnection> reader = open_connection(db_path, false);
+            if (!reader) return false;
+            idle_readers.push_back(reader.get());
+            readers.push_back(move(reader));
         }
+        log_message("دیتابیس SQLite3 با موفقیت باز شد (WAL، یک نویسنده و " + to_string(reader_count) + " اتصال خواندنی).");
         return true;
     }
-    
-    // متد دسترسی به SELECT
-    bool execute_query(const string& sql, vector<map<string, string>>& results) {
-        return execute_select(sql, results);
+
+    // متد اصلی برای اجرای INSERT, UPDATE, DELETE (استفاده از Prepared Statements)؛ statement از کش
+    // اتصال نویسنده می‌آید و فقط بار اول کامپایل می‌شود.
+    // last_insert_id در همان قفل نویسنده خوانده می‌شود تا با INSERT نخ دیگری قاطی نشود
+    bool prepare_and_execute(const string& sql, const vector<SqlParam>& params, long* last_insert_id = nullptr) {
+        unique_lock<timed_mutex> lock = lock_writer();
+        sqlite3* db = writer->db;
+        sqlite3_stmt* stmt = writer->statements.get(db, sql);
+        if (!stmt) return false;
+        StatementReset reset{stmt};
+        if (!bind_params(db, stmt, params)) return false;
+
+        if (sqlite3_step(stmt) != SQLITE_DONE) { // SQLITE_DONE برای INSERT, UPDATE, DELETE موفق است
+            log_message(LogLevel::ERROR, "خطا در اجرای کوئری: " + string(sqlite3_errmsg(db)));
+            return false;
+        }
+        if (last_insert_id) *last_insert_id = sqlite3_last_insert_rowid(db);
+        return true;
     }
     
-    // متد دسترسی به کوئری‌های بدون نتیجه (فقط برای CREATE TABLE)
-    bool execute_non_query(const string& sql) {
-        vector<map<string, string>> dummy_results;
-        return execute_select(sql, dummy_results);
+    // SELECT جریانی روی یکی از اتصال‌های خواندنی (موازی با سایر خواندن‌ها و نوشتن)
+    Cursor query(const string& sql, const vector<SqlParam>& params = {}) {
+        return Cursor(*this, sql, params);
     }
-    
-    // متد کمکی برای دریافت آخرین ID
-    long get_last_insert_id() {
-        lock_guard<mutex> lock(db_connection_mutex);
-        return sqlite3_last_insert_rowid(db_ptr);
+
+    // متد دسترسی به کوئری‌های بدون نتیجه (فقط برای CREATE TABLE هنگام راه‌اندازی؛ از کش عبور نمی‌کند)
+    bool execute_non_query(const string& sql) {
+        unique_lock<timed_mutex> lock = lock_writer();
+        return run_pragma(writer->db, sql);
     }
 };
 
@@ -280,562 +1314,3822 @@ unique_ptr<DatabaseManager> db_manager;
 // --- ۲. کلاس Router و توابع کمکی پروتکلی ---
 // ----------------------------------------------------------------------
 
-using HandlerFunc = function<string(const string& method, const string& path, const map<string, string>& headers, const string& body, int client_socket)>;
+// مقایسه بدون حساسیت به حروف بزرگ و کوچک (نام هدرها و توکن‌هایی مثل close)
+bool equals_ignore_case(string_view a, string_view b) {
+    if (a.length() != b.length()) return false;
+    for (size_t i = 0; i < a.length(); ++i) {
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
+    }
+    return true;
+}
 
-class Router {
+// پیمایش فهرست‌های جداشده با ویرگول در مقدار هدرها (مثل Accept-Encoding)؛ فاصله‌های اطراف هر عضو حذف می‌شود
+template <typename Callback>
+void for_each_list_item(string_view list, Callback callback) {
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        string_view item = list.substr(0, comma);
+        list = comma == string_view::npos ? string_view() : list.substr(comma + 1);
+        size_t first = item.find_first_not_of(" \t");
+        if (first == string_view::npos) continue;
+        item = item.substr(first, item.find_last_not_of(" \t") - first + 1);
+        if (!callback(item)) return;
+    }
+}
+
+// رمزگشایی درصدی مقادیر query string (application/x-www-form-urlencoded)؛ '+' به فاصله تبدیل می‌شود
+// و دنباله درصدی نامعتبر بدون تغییر باقی می‌ماند
+string url_decode(string_view text) {
+    auto hex_value = [](char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        c = (char)tolower((unsigned char)c);
+        return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+    };
+    string decoded;
+    decoded.reserve(text.length());
+    for (size_t i = 0; i < text.length(); ++i) {
+        if (text[i] == '+') {
+            decoded += ' ';
+        } else if (text[i] == '%' && i + 2 < text.length() && hex_value(text[i + 1]) >= 0 && hex_value(text[i + 2]) >= 0) {
+            decoded += (char)(hex_value(text[i + 1]) * 16 + hex_value(text[i + 2]));
+            i += 2;
+        } else {
+            decoded += text[i];
+        }
+    }
+    return decoded;
+}
+
+// بافر ورودی هر اتصال. داده‌ها پشت سر هم نگه داشته می‌شوند تا string_viewهای تجزیه‌گر پیوسته بمانند؛
+// بخش مصرف‌شده ابتدای بافر فقط وقتی برای نوشتن جا کم باشد با یک memmove جمع می‌شود.
+// هر string_view به داده بافر تا فراخوانی بعدی prepare یا append معتبر است.
+class InputBuffer {
 private:
-    map<string, HandlerFunc> routes;
+    vector<char> storage;
+    size_t head;
+    size_t tail;
 
 public:
-    void register_route(const string& method, const string& path, HandlerFunc handler) {
-        routes[method + " " + path] = handler;
+    InputBuffer() : head(0), tail(0) {}
+
+    const char* data() const { return storage.data() + head; }
+    size_t size() const { return tail - head; }
+    bool empty() const { return head == tail; }
+    string_view view() const { return string_view(data(), size()); }
+
+    void consume(size_t length) {
+        head += min(length, size());
+        if (head == tail) head = tail = 0;
     }
 
-    string route_request(const string& method, const string& path, const map<string, string>& headers, const string& body, int client_socket) {
-        // ۱. بررسی مسیرهای مستقیم
-        if (routes.count(method + " " + path)) {
-            return routes.at(method + " " + path)(method, path, headers, body, client_socket);
+    // فضای نوشتن دست‌کم min_space بایتی در انتهای بافر؛ طول واقعی با writable_size معلوم می‌شود
+    char* prepare(size_t min_space) {
+        if (empty() && storage.size() > INPUT_BUFFER_KEEP) {
+            vector<char>().swap(storage); // یک بدنه بزرگ نباید حافظه اتصال را برای همیشه نگه دارد
         }
-        
-        // ۲. بررسی مسیرهای با Wildcard (مانند DELETE /files/filename یا PUT /api/users/5)
-        
-        // Wildcard: DELETE /files/
-        if (method == "DELETE" && path.rfind("/files/", 0) == 0) {
-            if (routes.count(method + " " + "/files/")) {
-                return routes.at(method + " " + "/files/")(method, path, headers, body, client_socket);
+        if (storage.size() - tail < min_space && head > 0) {
+            memmove(storage.data(), storage.data() + head, tail - head);
+            tail -= head;
+            head = 0;
+        }
+        if (storage.size() - tail < min_space) {
+            storage.resize(tail + max(min_space, storage.size()));
+        }
+        return storage.data() + tail;
+    }
+
+    size_t writable_size() const { return storage.size() - tail; }
+
+    void commit(size_t length) { tail += length; }
+
+    void append(const char* bytes, size_t length) {
+        memcpy(prepare(length), bytes, length);
+        commit(length);
+    }
+};
+
+struct HeaderField {
+    string_view name;  // همان‌طور که کلاینت فرستاده (بدون تغییر حروف)
+    string_view value; // بدون فاصله‌های ابتدا و انتها
+};
+
+// هدرهایی که خود سرور یا هندلرها مرتب می‌خوانند؛ جایگاهشان هنگام تجزیه یک‌بار پیدا می‌شود
+enum class KnownHeader {
+    CONTENT_LENGTH,
+    CONNECTION,
+    RANGE,
+    IF_RANGE,
+    ACCEPT_ENCODING,
+    IF_NONE_MATCH,
+    IF_MODIFIED_SINCE,
+    TRANSFER_ENCODING,
+    COUNT
+};
+
+const string_view KNOWN_HEADER_NAMES[] = {
+    "content-length", "connection", "range", "if-range", "accept-encoding", "if-none-match", "if-modified-since",
+    "transfer-encoding"
+};
+
+// درخواست تجزیه‌شده. همه string_viewها (مسیر، هدرها و بدنه) به InputBuffer اتصال اشاره می‌کنند
+// و فقط تا پایان اجرای هندلر معتبرند. تا INLINE_HEADERS هدر بدون تخصیص حافظه نگه داشته می‌شود.
+class Request {
+public:
+    static const size_t INLINE_HEADERS = 24;
+    static const size_t MAX_ROUTE_PARAMS = 8;
+
+    string_view method;
+    string_view target; // مسیر همراه query
+    string_view path;
+    string_view query;
+    string_view version;
+    string_view body; // برای بدنه جریانی فقط بخشی که همراه هدرها رسیده است
+    long content_length = 0;
+    bool keep_alive = true;
+    size_t head_length = 0; // طول خط اول و هدرها تا پایان خط خالی
+    uint8_t route_id = 0;   // شناسه مسیر منطبق برای لاگ دسترسی؛ 0 یعنی بدون تطبیق
+
+    Request() { clear_headers(); }
+
+    void clear_headers() {
+        header_count = 0;
+        overflow_headers.clear();
+        known_slots.fill(-1);
+    }
+
+    void add_header(string_view name, string_view value) {
+        int index = (int)header_count++;
+        if ((size_t)index < INLINE_HEADERS) inline_headers[index] = {name, value};
+        else overflow_headers.push_back({name, value});
+
+        for (size_t slot = 0; slot < (size_t)KnownHeader::COUNT; ++slot) {
+            // در صورت تکرار، اولین مقدار معتبر است
+            if (known_slots[slot] < 0 && equals_ignore_case(name, KNOWN_HEADER_NAMES[slot])) {
+                known_slots[slot] = index;
+                break;
             }
         }
-        
-        // Wildcard: PUT /api/users/
-        if (method == "PUT" && path.rfind("/api/users/", 0) == 0) {
-             if (routes.count(method + " " + "/api/users/")) {
-                return routes.at(method + " " + "/api/users/")(method, path, headers, body, client_socket);
-            }
-        }
-
-        if (method == "GET") {
-            if (path == "/") {
-                // صفحه اصلی HTML کامل از فایل index.html (که در Router نیست)
-                string full_path = WEB_ROOT + "/index.html";
-                serve_static_file(client_socket, full_path);
-                return "SERVED";
-            } 
-            else if (path.rfind("/files/", 0) == 0 || path.find('.') != string::npos) { 
-                // سرویس‌دهی فایل‌های استاتیک (مثل css و js) و فایل‌های آپلودی
-                string full_path;
-                if (path.rfind("/files/", 0) == 0) {
-                    full_path = UPLOAD_ROOT + path.substr(7);
-                } else {
-                    full_path = WEB_ROOT + sanitize_path(path);
+    }
+
+    size_t header_size() const { return header_count; }
+
+    const HeaderField& header_at(size_t index) const {
+        return index < INLINE_HEADERS ? inline_headers[index] : overflow_headers[index - INLINE_HEADERS];
+    }
+
+    bool has_header(KnownHeader header) const { return known_slots[(size_t)header] >= 0; }
+
+    // مقدار هدر شناخته‌شده؛ در نبود هدر string_view خالی
+    string_view header(KnownHeader header) const {
+        int index = known_slots[(size_t)header];
+        return index < 0 ? string_view() : header_at(index).value;
+    }
+
+    // پارامترهای مسیر (مثل :id یا *rest) که Router هنگام تطبیق پر می‌کند؛ در نبود پارامتر string_view خالی
+    string_view param(string_view name) const {
+        for (size_t i = 0; i < param_count; ++i) {
+            if (params[i].name == name) return params[i].value;
+        }
+        return string_view();
+    }
+
+    // پارامتر query string (بخش پس از ?) با رمزگشایی درصدی؛ false اگر وجود نداشته باشد.
+    // در صورت تکرار، اولین مقدار معتبر است
+    bool query_param(string_view name, string& value) const {
+        string_view rest = query;
+        while (!rest.empty()) {
+            size_t amp = rest.find('&');
+            string_view pair = rest.substr(0, amp);
+            rest = amp == string_view::npos ? string_view() : rest.substr(amp + 1);
+            size_t equals = pair.find('=');
+            if (pair.substr(0, equals) != name) continue;
+            value = equals == string_view::npos ? string() : url_decode(pair.substr(equals + 1));
+            return true;
+        }
+        return false;
+    }
+
+    void clear_params() { param_count = 0; }
+
+    bool push_param(string_view name, string_view value) {
+        if (param_count == MAX_ROUTE_PARAMS) return false;
+        params[param_count++] = {name, value};
+        return true;
+    }
+
+    void pop_param() { --param_count; }
+
+    // جستجوی خطی بدون حساسیت به حروف برای سایر هدرها
+    const HeaderField* find_header(string_view name) const {
+        for (size_t i = 0; i < header_count; ++i) {
+            if (equals_ignore_case(header_at(i).name, name)) return &header_at(i);
+        }
+        return nullptr;
+    }
+
+private:
+    HeaderField inline_headers[INLINE_HEADERS];
+    size_t header_count;
+    vector<HeaderField> overflow_headers; // فقط برای درخواست‌های کم‌یاب با هدرهای بسیار زیاد
+    array<int, (size_t)KnownHeader::COUNT> known_slots;
+
+    struct RouteParam {
+        string_view name; // به نام ذخیره‌شده در درخت Router اشاره می‌کند
+        string_view value;
+    };
+    RouteParam params[MAX_ROUTE_PARAMS];
+    size_t param_count = 0;
+};
+
+// تجزیه‌گر افزایشی HTTP/1.x: هر بار فقط خط‌های تازه رسیده را بررسی می‌کند و وضعیتش بین read()ها باقی می‌ماند.
+// چون بافر ممکن است بین دو فراخوانی جابه‌جا شود، مکان بخش‌ها به صورت offset نگه داشته می‌شود.
+class HttpParser {
+public:
+    enum class Status { INCOMPLETE, COMPLETE, INVALID, TOO_LARGE, UNSUPPORTED_ENCODING };
+
+private:
+    struct Span {
+        uint32_t start;
+        uint32_t length;
+    };
+    struct HeaderSpan {
+        Span name;
+        Span value;
+    };
+
+    enum class State { REQUEST_LINE, HEADERS };
+    State state;
+    size_t line_start; // ابتدای اولین خطی که هنوز کامل دریافت نشده
+    Span method, target, version;
+    vector<HeaderSpan> header_spans;
+
+    static string_view at(string_view data, Span span) { return data.substr(span.start, span.length); }
+
+    bool parse_request_line(size_t start, string_view line) {
+        size_t method_end = line.find(' ');
+        if (method_end == string_view::npos || method_end == 0) return false;
+        size_t target_end = line.find(' ', method_end + 1);
+        if (target_end == string_view::npos || target_end == method_end + 1) return false;
+        string_view version_text = line.substr(target_end + 1);
+        if (version_text.substr(0, 7) != "HTTP/1.") return false;
+
+        method = {(uint32_t)start, (uint32_t)method_end};
+        target = {(uint32_t)(start + method_end + 1), (uint32_t)(target_end - method_end - 1)};
+        version = {(uint32_t)(start + target_end + 1), (uint32_t)version_text.length()};
+        return true;
+    }
+
+    bool parse_header_line(size_t start, string_view line) {
+        // ادامه هدر در خط بعد (obs-fold) منسوخ است و رد می‌شود
+        if (line[0] == ' ' || line[0] == '\t') return false;
+        size_t colon = line.find(':');
+        if (colon == string_view::npos || colon == 0 || line[colon - 1] == ' ' || line[colon - 1] == '\t') return false;
+
+        size_t value_start = colon + 1;
+        size_t value_end = line.length();
+        while (value_start < value_end && (line[value_start] == ' ' || line[value_start] == '\t')) ++value_start;
+        while (value_end > value_start && (line[value_end - 1] == ' ' || line[value_end - 1] == '\t')) --value_end;
+
+        header_spans.push_back({{(uint32_t)start, (uint32_t)colon},
+                                {(uint32_t)(start + value_start), (uint32_t)(value_end - value_start)}});
+        return true;
+    }
+
+    // ساخت string_viewها روی داده فعلی بافر و استخراج هدرهای مورد نیاز خود سرور
+    Status finish(string_view data, Request& request) {
+        request.method = at(data, method);
+        request.target = at(data, target);
+        request.version = at(data, version);
+        size_t query_pos = request.target.find('?');
+        request.path = request.target.substr(0, query_pos);
+        request.query = query_pos == string_view::npos ? string_view() : request.target.substr(query_pos + 1);
+        request.body = string_view();
+
+        request.clear_headers();
+        request.content_length = 0;
+        for (const HeaderSpan& span : header_spans) {
+            string_view name = at(data, span.name);
+            string_view value = at(data, span.value);
+            if (equals_ignore_case(name, "content-length")) {
+                long length = 0;
+                if (value.empty() || value.length() > 18) return Status::INVALID;
+                for (char c : value) {
+                    if (c < '0' || c > '9') return Status::INVALID;
+                    length = length * 10 + (c - '0');
                 }
-                serve_static_file(client_socket, full_path);
-                return "SERVED"; 
+                // چند Content-Length متفاوت راه قاچاق درخواست (request smuggling) است
+                if (request.has_header(KnownHeader::CONTENT_LENGTH) && length != request.content_length) return Status::INVALID;
+                request.content_length = length;
             }
+            request.add_header(name, value);
         }
-        
-        // پاسخ ۴۰۴
-        return build_http_response("<h1>404</h1><p>مسیر مورد نظر وجود ندارد.</p>", 404);
+        // بدنه با Transfer-Encoding (مثل chunked) پشتیبانی نمی‌شود؛ اگر نادیده گرفته شود بدنه به عنوان
+        // درخواست بعدی تجزیه می‌شود. همراه Content-Length همان حالت قاچاق TE/CL است و نامعتبر حساب می‌شود
+        if (request.has_header(KnownHeader::TRANSFER_ENCODING)) {
+            return request.has_header(KnownHeader::CONTENT_LENGTH) ? Status::INVALID : Status::UNSUPPORTED_ENCODING;
+        }
+        // Connection فهرستی از گزینه‌هاست؛ پیش‌فرض HTTP/1.1 ماندگاری و پیش‌فرض HTTP/1.0 بستن اتصال است
+        bool close_option = false;
+        bool keep_alive_option = false;
+        for_each_list_item(request.header(KnownHeader::CONNECTION), [&](string_view option) {
+            if (equals_ignore_case(option, "close")) close_option = true;
+            else if (equals_ignore_case(option, "keep-alive")) keep_alive_option = true;
+            return true;
+        });
+        request.keep_alive = !close_option && (request.version != "HTTP/1.0" || keep_alive_option);
+        return Status::COMPLETE;
     }
-};
 
-// --- ۳. توابع کمکی پروتکلی (پروتکل و I/O) ---
-string sanitize_path(string path) {
-    size_t pos = path.find("..");
-    while (pos != string::npos) {
-        path.replace(pos, 2, ".");
-        pos = path.find("..", pos);
+public:
+    HttpParser() { reset(); }
+
+    void reset() {
+        state = State::REQUEST_LINE;
+        line_start = 0;
+        header_spans.clear();
     }
-    if (path.empty() || path[0] != '/') {
-        path.insert(0, "/");
+
+    // data از ابتدای درخواست جاری شروع می‌شود؛ با رسیدن داده بیشتر دوباره با همان ابتدا فراخوانی می‌شود
+    Status parse(string_view data, Request& request) {
+        while (true) {
+            // بافر خالی ممکن است اشاره‌گر null داشته باشد که memchr نمی‌پذیرد
+            const char* newline = data.length() > line_start
+                                      ? (const char*)memchr(data.data() + line_start, '\n', data.length() - line_start)
+                                      : nullptr;
+            if (newline == nullptr) {
+                return data.length() > MAX_HEADER_SIZE ? Status::TOO_LARGE : Status::INCOMPLETE;
+            }
+            size_t line_end = newline - data.data();
+            size_t next_line = line_end + 1;
+            if (next_line > MAX_HEADER_SIZE) return Status::TOO_LARGE;
+            size_t content_end = (line_end > line_start && data[line_end - 1] == '\r') ? line_end - 1 : line_end;
+            string_view line = data.substr(line_start, content_end - line_start);
+
+            if (state == State::REQUEST_LINE) {
+                // خط‌های خالی پیش از خط اول (مثلاً CRLF اضافه پس از بدنه قبلی) نادیده گرفته می‌شوند
+                if (!line.empty()) {
+                    if (!parse_request_line(line_start, line)) return Status::INVALID;
+                    state = State::HEADERS;
+                }
+            } else if (line.empty()) {
+                request.head_length = next_line;
+                return finish(data, request);
+            } else {
+                if (header_spans.size() >= MAX_HEADER_COUNT) return Status::TOO_LARGE;
+                if (!parse_header_line(line_start, line)) return Status::INVALID;
+            }
+            line_start = next_line;
+        }
     }
-    return path;
-}
+};
 
-string build_http_response(const string& content, int status_code, const string& content_type = "text/html") {
-    stringstream response;
-    string status_text;
-    
-    // تخصیص متن وضعیت بر اساس کد
-    if (status_code == 200) status_text = "OK";
-    else if (status_code == 201) status_text = "Created";
-    else if (status_code == 400) status_text = "Bad Request";
-    else if (status_code == 403) status_text = "Forbidden";
-    else if (status_code == 404) status_text = "Not Found";
-    else if (status_code == 500) status_text = "Internal Server Error";
-    else status_text = "Unknown";
-    
-    response << "HTTP/1.1 " << status_code << " " << status_text << "\r\n";
-    response << "Content-Type: " << content_type << "\r\n";
-    response << "Content-Length: " << content.length() << "\r\n";
-    response << "Connection: keep-alive\r\n";
-    response << "\r\n";
-    response << content;
-    
-    return response.str();
-}
+// ----------------------------------------------------------------------
+// --- چرخ زمان‌سنج سلسله‌مراتبی (مهلت‌های اتصال) ---
+// ----------------------------------------------------------------------
+
+// مرحله‌ای که اتصال (بدون نخ پردازشگر) در آن منتظر کلاینت است؛ هر مرحله مهلت جداگانه دارد (ServerConfig)
+enum class ConnectionPhase : uint8_t {
+    HEADER, // بخشی از هدرهای درخواست رسیده است (یا اتصال تازه پذیرفته شده)؛ مهلت مطلق از اولین بایت
+    BODY,   // هدرها کامل و منتظر بقیه بدنه (بافرشده یا جریانی مثل آپلود)؛ مهلت بین دو دریافت
+    IDLE,   // keep-alive بین دو درخواست
+    WRITE,  // صف خروجی به EAGAIN خورده و منتظر خواندن کلاینت است؛ مهلت بین دو ارسال موفق
+};
 
-string build_http_response_cacheable(long file_size, const string& content_type) {
-    stringstream response;
-    response << "HTTP/1.1 200 OK\r\n";
-    response << "Content-Type: " << content_type << "\r\n";
-    response << "Content-Length: " << file_size << "\r\n";
-    response << "Connection: keep-alive\r\n";
-    response << "Cache-Control: public, max-age=604800\r\n"; // کش کردن برای یک هفته
-    response << "\r\n";
-    return response.str();
+uint64_t monotonic_ms() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-string get_mime_type(const string& file_path) {
-    size_t dot_pos = file_path.find_last_of('.');
-    if (dot_pos == string::npos) return "text/plain"; 
+// گره درون اتصال (intrusive)؛ زمان‌سنج اتصال بیکار هیچ تخصیص حافظه‌ای ندارد
+struct TimerNode {
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;
+    uint64_t expires = 0; // تیک انقضا
+    Connection* owner = nullptr;
 
-    string ext = file_path.substr(dot_pos + 1);
+    bool scheduled() const { return next != nullptr; }
+};
 
-    if (ext == "html" || ext == "htm") return "text/html";
-    if (ext == "css") return "text/css";
-    if (ext == "js") return "application/javascript";
-    if (ext == "jpg" || ext == "jpeg") return "image/jpeg";
-    if (ext == "png") return "image/png";
-    if (ext == "gif") return "image/gif";
-    if (ext == "ico") return "image/x-icon";
-    if (ext == "mp4") return "video/mp4";
-    if (ext == "json") return "application/json";
-    
-    return "application/octet-stream";
-}
+// چرخ زمان‌سنج سلسله‌مراتبی (Varghese/Lauck): ۴ سطح ۶۴ خانه‌ای با تیک TIMER_TICK_MS.
+// زمان‌بندی و لغو O(1) است؛ زمان‌سنج‌های دور در سطح‌های بالاتر می‌مانند و با رسیدن زمانشان به سطح
+// پایین‌تر منتقل (cascade) می‌شوند. متعلق به یک حلقه رویداد است و خودش قفلی ندارد.
+class TimerWheel {
+private:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const size_t SLOTS = 1 << SLOT_BITS;
+    static const uint64_t MAX_DELTA = ((uint64_t)1 << (SLOT_BITS * LEVELS)) - 1;
 
-void serve_static_file(int client_socket, const string& full_path) { 
-    // تابع برای ارسال فایل‌های استاتیک یا آپلودی
-    ifstream file(full_path, ios::binary | ios::ate);
-    
-    if (!file.is_open()) {
-        string content = "<h1>404 - پیدا نشد</h1><p>فایل یا مسیر در سرور پیدا نشد.</p>";
-        string response_str = build_http_response(content, 404);
-        send(client_socket, response_str.c_str(), response_str.length(), 0);
-        return;
+    TimerNode heads[LEVELS][SLOTS]; // سر لیست‌های حلقوی هر خانه
+    uint64_t current_tick;
+    size_t count = 0;
+
+    void link(TimerNode* node) {
+        uint64_t delta = node->expires - current_tick;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= ((uint64_t)1 << (SLOT_BITS * (level + 1)))) ++level;
+        TimerNode* head = &heads[level][(node->expires >> (SLOT_BITS * level)) & (SLOTS - 1)];
+        node->prev = head;
+        node->next = head->next;
+        head->next->prev = node;
+        head->next = node;
     }
-    
-    long file_size = file.tellg();
-    file.seekg(0, ios::beg);
 
-    string mime_type = get_mime_type(full_path);
-    
-    string response_headers = build_http_response_cacheable(file_size, mime_type);
-    send(client_socket, response_headers.c_str(), response_headers.length(), 0);
-    
-    vector<char> buffer(BUFFER_SIZE);
-    
-    while (file.read(buffer.data(), buffer.size())) {
-        send(client_socket, buffer.data(), file.gcount(), 0);
+    static void unlink(TimerNode* node) {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = nullptr;
     }
-    if (file.gcount() > 0) {
-        send(client_socket, buffer.data(), file.gcount(), 0);
+
+    void cascade(int level) {
+        TimerNode* head = &heads[level][(current_tick >> (SLOT_BITS * level)) & (SLOTS - 1)];
+        while (head->next != head) {
+            TimerNode* node = head->next;
+            unlink(node);
+            link(node);
+        }
     }
-}
 
-string list_files(const string& upload_dir) {
-    // تابع ساخت صفحه HTML مدیریت فایل (File Manager)
-    string html_content =
-        "<!DOCTYPE html><html><head><title>مدیریت فایل</title><link rel=\"stylesheet\" href=\"/style.css\"></head><body class=\"list-files-section\">"
-        "<h1>مدیریت فایل‌ها (فایل منیجر)</h1>"
-        "<p>فایل‌های آپلود شده در پوشه‌ی <code>uploads/</code> ذخیره می‌شوند. این فرآیند از <a href=\"/\" style=\"color:#3498db;\">Streaming Upload</a> استفاده می‌کند.</p>"
-        
-        "<h2>✅ آپلود فایل جدید</h2>"
-        "<div class=\"upload-box\">"
-        "<input type=\"file\" id=\"fileInput\" required>"
-        "<button onclick=\"uploadFile()\">آپلود فایل</button>"
-        "<span id=\"uploadStatus\" style=\"margin-right: 15px; font-weight: bold;\"></span>"
-        "</div>"
-        
-        "<h2>📂 فایل‌های ذخیره شده</h2><ul>";
+public:
+    TimerWheel() : current_tick(monotonic_ms() / TIMER_TICK_MS) {
+        for (auto& level : heads) {
+            for (TimerNode& head : level) head.prev = head.next = &head;
+        }
+    }
 
-    DIR *dir;
-    struct dirent *ent;
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
 
-    if ((dir = opendir(upload_dir.c_str())) != NULL) {
-        while ((ent = readdir(dir)) != NULL) {
-            string filename = ent->d_name;
-            if (filename != "." && filename != "..") {
-                // نمایش فایل و دکمه حذف
-                html_content += "<li>"
-                                "<a href=\"/files/" + filename + "\" target=\"_blank\">" + filename + "</a>"
-                                "<button onclick=\"deleteFile('" + filename + "')\">حذف دائمی</button>"
-                                "</li>";
+    // زمان‌بندی دوباره یک گره فعال، مهلت قبلی آن را لغو می‌کند
+    void schedule(TimerNode* node, uint64_t now_ms, uint64_t delay_ms) {
+        cancel(node);
+        uint64_t expires = (now_ms + delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+        node->expires = min(max(expires, current_tick + 1), current_tick + MAX_DELTA);
+        link(node);
+        ++count;
+    }
+
+    void cancel(TimerNode* node) {
+        if (!node->scheduled()) return;
+        unlink(node);
+        --count;
+    }
+
+    // مهلت مناسب برای epoll_wait: تا تیک بعد، یا -1 وقتی زمان‌سنجی فعال نیست
+    int poll_timeout_ms(uint64_t now_ms) const {
+        if (count == 0) return -1;
+        uint64_t next_tick_ms = (current_tick + 1) * TIMER_TICK_MS;
+        return next_tick_ms > now_ms ? (int)(next_tick_ms - now_ms) : 0;
+    }
+
+    bool empty() const { return count == 0; }
+
+    // جلو بردن چرخ تا now_ms؛ on_expire برای هر گره منقضی (که دیگر زمان‌بندی‌شده نیست) صدا زده می‌شود
+    template <typename Callback>
+    void advance(uint64_t now_ms, Callback on_expire) {
+        uint64_t target = now_ms / TIMER_TICK_MS;
+        if (count == 0) {
+            current_tick = max(current_tick, target);
+            return;
+        }
+        while (current_tick < target) {
+            ++current_tick;
+            for (int level = LEVELS - 1; level > 0; --level) {
+                if ((current_tick & (((uint64_t)1 << (SLOT_BITS * level)) - 1)) == 0) cascade(level);
+            }
+            TimerNode* head = &heads[0][current_tick & (SLOTS - 1)];
+            while (head->next != head) {
+                TimerNode* node = head->next;
+                unlink(node);
+                --count;
+                on_expire(node);
             }
         }
-        closedir(dir);
-    } else {
-        html_content += "<li>خطا: قادر به باز کردن پوشه‌ی آپلود نیست. مطمئن شوید پوشه <code>uploads/</code> وجود دارد.</li>";
     }
+};
 
-    html_content += "</ul>";
-    
-    // جاوااسکریپت ساده برای آپلود و حذف
-    html_content +=
-        "<script>"
-        "function uploadFile() {"
-            "const fileInput = document.getElementById('fileInput');"
-            "const statusSpan = document.getElementById('uploadStatus');"
-            "const file = fileInput.files[0];"
-            "if (!file) { alert('لطفا یک فایل انتخاب کنید.'); return; }"
-            
-            "statusSpan.textContent = 'در حال آپلود...'; statusSpan.style.color = '#e67e22';"
-            "const xhr = new XMLHttpRequest();"
-            "xhr.open('POST', '/upload', true);"
-            "xhr.setRequestHeader('Content-Type', 'application/octet-stream');" 
-            
-            "xhr.onload = function() {"
-                "let response = {error: 'خطای نامشخص'};"
-                "try { response = JSON.parse(xhr.responseText); } catch(e) {}"
-                
-                "if (xhr.status === 200) {"
-                    "statusSpan.textContent = '✅ آپلود موفقیت‌آمیز';"
-                    "setTimeout(() => { window.location.reload(); }, 1500);" 
-                "} else {"
-                    "statusSpan.textContent = '❌ خطای آپلود';"
-                    "alert('خطا در آپلود: ' + (response.error || 'Server Error.'));"
-                "}"
-            "};"
-            
-            "xhr.onerror = function() {"
-                "statusSpan.textContent = '❌ خطای شبکه';"
-                "alert('خطای شبکه رخ داد.');"
-            "};"
-            
-            "xhr.send(file);" 
-        "}"
-        
-        "function deleteFile(filename) {"
-            "if (confirm('⚠️ آیا مطمئن هستید که می‌خواهید ' + filename + ' را حذف کنید؟ این عملیات برگشت ناپذیر است.')) {"
-                "const xhr = new XMLHttpRequest();"
-                "xhr.open('DELETE', '/files/' + filename, true);"
-                
-                "xhr.onload = function() {"
-                    "const response = JSON.parse(xhr.responseText);"
-                    "if (xhr.status === 200) {"
-                        "alert('✅ حذف موفقیت‌آمیز: ' + response.message);"
-                        "window.location.reload();"
-                    "} else {"
-                        "alert('❌ خطا در حذف فایل: ' + response.error);"
-                    "}"
-                "};"
-                "xhr.send();"
-            "}"
-        "}"
-        "</script>"
-        "<p><a href=\"/\">بازگشت به صفحه اصلی</a></p>"
-        "</body></html>";
-    
-    return html_content;
-}
+// فایل باز شده برای پاسخ؛ تا ارسال آخرین بازه آن از صف خروجی باز می‌ماند
+struct OpenFile {
+    int fd;
 
+    explicit OpenFile(int file_fd) : fd(file_fd) {}
+    ~OpenFile() { close(fd); }
 
-void handle_upload_stream(int client_socket, const string& initial_body, long content_length) {
+    OpenFile(const OpenFile&) = delete;
+    OpenFile& operator=(const OpenFile&) = delete;
+};
+
+// یک تکه از خروجی منتظر ارسال: حافظه متعلق به خود تکه (owned)، حافظه تغییرناپذیر مشترک مثل پاسخ
+// کش‌شده (data با keeper) یا بازه‌ای از فایل باز (file_fd با keeper). offset و length پس از هر ارسال
+// ناقص جلو می‌روند.
+struct OutputSegment {
+    string owned;
+    shared_ptr<const void> keeper; // مالک data یا فایل؛ تا ارسال کامل تکه زنده می‌ماند
+    const char* data = nullptr;    // nullptr یعنی داده در owned است
+    int file_fd = -1;
+    uint64_t offset = 0; // بایت‌های ارسال‌شده از تکه حافظه، یا آفست فعلی در فایل
+    size_t length = 0;   // بایت‌های باقیمانده
+
+    bool is_file() const { return file_fd >= 0; }
+    const char* bytes() const { return (data ? data : owned.data()) + offset; }
+};
+
+// صف خروجی اتصال. هندلرها فقط به آن اضافه می‌کنند و موتور I/O هر وقت سوکت آماده بود آن را ارسال
+// می‌کند، پس هیچ نخی منتظر کلاینت کند نمی‌ماند. بدنه‌ها کپی نمی‌شوند: رشته‌ها منتقل (move) و پاسخ‌های
+// کش‌شده با shared_ptr نگه داشته می‌شوند.
+class OutputQueue {
+private:
+    deque<OutputSegment> segments;
+    size_t total = 0; // مجموع بایت‌های ارسال‌نشده (شامل بازه‌های فایل)
+
+public:
+    bool empty() const { return segments.empty(); }
+    size_t bytes() const { return total; }
+    OutputSegment& front() { return segments.front(); }
+
+    void append(string&& data) {
+        if (data.empty()) return;
+        OutputSegment& segment = segments.emplace_back();
+        segment.length = data.length();
+        segment.owned = move(data);
+        total += segment.length;
+    }
+
+    void append(shared_ptr<const string> owner, size_t offset, size_t length) {
+        if (length == 0) return;
+        OutputSegment& segment = segments.emplace_back();
+        segment.data = owner->data() + offset;
+        segment.length = length;
+        segment.keeper = move(owner);
+        total += length;
+    }
+
+    void append_file(shared_ptr<OpenFile> file, off_t offset, size_t length) {
+        if (length == 0) return;
+        OutputSegment& segment = segments.emplace_back();
+        segment.file_fd = file->fd;
+        segment.offset = offset;
+        segment.length = length;
+        segment.keeper = move(file);
+        total += length;
+    }
+
+    // انتقال همه تکه‌ها به انتهای صف دیگر بدون کپی داده (deque ارجاع به تکه‌های موجود آن را باطل نمی‌کند)
+    void move_to(OutputQueue& other) {
+        for (OutputSegment& segment : segments) {
+            other.segments.push_back(move(segment));
+        }
+        other.total += total;
+        segments.clear();
+        total = 0;
+    }
+
+    void clear() {
+        segments.clear();
+        total = 0;
+    }
+
+    // length بایت ابتدای تکه فایل جلوی صف در buffer خوانده شده است؛ آن بایت‌ها از این پس تکه حافظه‌ای
+    // بدون keeper در ابتدای صف‌اند (buffer متعلق به صاحب صف است و تا ارسالشان تغییر نمی‌کند)
+    void stage_file_front(const char* buffer, size_t length) {
+        OutputSegment& file = segments.front();
+        file.offset += length;
+        file.length -= length;
+        if (file.length == 0) segments.pop_front();
+        OutputSegment& segment = segments.emplace_front();
+        segment.data = buffer;
+        segment.length = length;
+    }
+
+    // iovec برای تکه‌های حافظه ابتدای صف تا رسیدن به تکه فایل یا max_count؛
+    // more یعنی پس از آن‌ها هنوز تکه‌ای (مثلاً بدنه فایل) در صف هست
+    size_t gather(struct iovec* iov, size_t max_count, bool& more) const {
+        size_t count = 0;
+        for (const OutputSegment& segment : segments) {
+            if (segment.is_file() || count == max_count) break;
+            iov[count].iov_base = const_cast<char*>(segment.bytes());
+            iov[count].iov_len = segment.length;
+            ++count;
+        }
+        more = count < segments.size();
+        return count;
+    }
+
+    // کنار گذاشتن length بایت ارسال‌شده از ابتدای صف
+    void consume(size_t length) {
+        total -= length;
+        while (length > 0) {
+            OutputSegment& segment = segments.front();
+            size_t used = min(length, segment.length);
+            segment.offset += used;
+            segment.length -= used;
+            length -= used;
+            if (segment.length == 0) segments.pop_front();
+        }
+    }
+};
+
+// پاسخی که در چند مرحله تولید می‌شود (مثلاً خروجی جریانی /api/users). موتور I/O هر بار که صف خروجی
+// اتصال خالی شد produce را صدا می‌زند، پس حافظه پاسخ به یک فریم محدود است و نخی منتظر کلاینت نمی‌ماند.
+class ResponseProducer {
+public:
+    enum class Result { MORE, DONE, FAILED }; // FAILED: پاسخ ناقص ماند و اتصال بسته می‌شود
+
+    virtual ~ResponseProducer() {}
+    virtual Result produce(Connection& conn) = 0;
+};
+
+// مصرف‌کننده بدنه جریانی درخواست (مثلاً آپلود بزرگ). بایت‌ها هر بار که از سوکت می‌رسند تحویل داده
+// می‌شوند؛ اتصالی که پیش از رسیدن کل بدنه بسته شود sink را بدون finish نابود می‌کند.
+class BodySink {
+public:
+    uint64_t remaining; // بایت‌های بدنه که هنوز نرسیده‌اند
+
+    explicit BodySink(uint64_t length) : remaining(length) {}
+    virtual ~BodySink() {}
+    virtual void write(const char* data, size_t length) = 0;
+    virtual void finish(Connection& conn) = 0; // کل بدنه رسیده است؛ پاسخ را به صف اضافه می‌کند
+};
+
+// وضعیت هر اتصال؛ بین رویدادهای حلقه I/O باقی می‌ماند تا درخواست‌های نیمه‌کاره از دست نروند.
+// خروجی به صف output اضافه می‌شود و ارسالش با موتور I/O (epoll یا io_uring) است، تا هندلرها مستقل از
+// موتور باشند و هیچ‌کدام منتظر سوکت نمانند.
+class Connection {
+public:
+    int fd;
+    InputBuffer in_buffer; // بایت‌های دریافت شده‌ای که هنوز به درخواست کامل تبدیل نشده‌اند
+    HttpParser parser;     // وضعیت تجزیه درخواست جاری (ممکن است در چند read() برسد)
+    Request request;       // فقط در حین پردازش یک درخواست معتبر است
+    OutputQueue output;    // پاسخ‌های تولیدشده که هنوز به کرنل سپرده نشده‌اند
+
+    // پاسخ یا بدنه درخواست جاری که در دورهای بعدی کامل می‌شود
+    unique_ptr<ResponseProducer> producer;
+    unique_ptr<BodySink> body_sink;
+
+    // آمار درخواست جاری برای متریک و لاگ دسترسی (در process_buffered_requests مقدار می‌گیرند)
+    uint64_t response_bytes = 0;
+    int response_status = 0;
+    uint64_t request_timestamp_us = 0;
+    chrono::steady_clock::time_point request_started;
+    uint8_t request_method = 0; // HttpMethod
+    uint8_t request_route_id = 0;
+    uint64_t request_bytes = 0;
+    bool keep_alive = true; // آیا پس از پاسخ جاری اتصال باز می‌ماند؛ هدر Connection همه پاسخ‌ها از آن ساخته می‌شود
+    bool close_after_output = false; // پس از ارسال کامل output اتصال بسته می‌شود
+
+    // مهلت انتظار برای کلاینت؛ فقط وقتی هیچ نخ پردازشگری روی اتصال کار نمی‌کند در چرخ زمان‌سنج حلقه قرار دارد
+    ConnectionPhase phase = ConnectionPhase::HEADER;
+    uint64_t header_deadline_ms = 0; // مهلت مطلق دریافت کامل هدرهای درخواست جاری؛ 0 یعنی هنوز شروع نشده
+    TimerNode idle_timer;
+    uint32_t peer_ip; // برای آزاد کردن سهم IP در کنترل پذیرش
+
+    // فقط پس از AdmissionControl::try_admit موفق ساخته می‌شود
+    Connection(int socket_fd, uint32_t ip) : fd(socket_fd), peer_ip(ip) {
+        idle_timer.owner = this;
+        metrics.connection_opened();
+    }
+    virtual ~Connection() {
+        metrics.connection_closed();
+        admission.release(peer_ip);
+    }
+
+    // افزودن به صف خروجی؛ ارسال واقعی پس از بازگشت هندلر توسط موتور I/O انجام می‌شود
+    void send(string data) {
+        response_bytes += data.length();
+        output.append(move(data));
+    }
+
+    // بخشی از داده تغییرناپذیر مشترک (مثل پاسخ کش‌شده) بدون کپی
+    void send_shared(shared_ptr<const string> data, size_t offset, size_t length) {
+        response_bytes += length;
+        output.append(move(data), offset, length);
+    }
+
+    // بازه‌ای از فایل: epoll آن را بدون کپی در فضای کاربر با sendfile می‌فرستد و io_uring تکه‌تکه با READ به بافر اتصال می‌خواند
+    void send_file(shared_ptr<OpenFile> file, off_t offset, size_t length) {
+        response_bytes += length;
+        output.append_file(move(file), offset, length);
+    }
+};
+
+// پاسخ یک هندلر. send_response هدرها را در یک رشته کوچک می‌سازد و بدنه بدون کپی (با انتقال مالکیت)
+// کنار آن در صف خروجی قرار می‌گیرد؛ هر دو با یک sendmsg ارسال می‌شوند.
+struct HttpResponse {
+    int status_code = 200;
+    string_view content_type = "text/html"; // هنگام ساخت هدرها کپی می‌شود (معمولاً یک literal)
+    string body;
+    string extra_headers;  // هدرهای اضافه، هر کدام با \r\n
+    bool already_sent = false; // هندلر خودش پاسخ را به صف اضافه کرده است (فایل، پاسخ یا بدنه جریانی)
+    bool close_connection = false; // پاسخ ارسال‌شده ناقص است یا پایانش با بستن اتصال مشخص می‌شود
+
+    static HttpResponse sent(bool close_connection = false) {
+        HttpResponse response;
+        response.already_sent = true;
+        response.close_connection = close_connection;
+        return response;
+    }
+};
+
+using HandlerFunc = function<HttpResponse(const Request& request, Connection& conn)>;
+
+// ----------------------------------------------------------------------
+// --- جدول مسیرهای ثابت در زمان کامپایل (perfect hash) ---
+// ----------------------------------------------------------------------
+
+enum class HttpMethod : uint8_t { GET, HEAD, POST, PUT, PATCH, DELETE, OPTIONS, OTHER };
+static_assert(HTTP_METHOD_COUNT == (size_t)HttpMethod::OTHER + 1, "HTTP_METHOD_NAMES must follow HttpMethod");
+
+HttpMethod parse_http_method(string_view method) {
+    switch (method.length()) {
+        case 3: return method == "GET" ? HttpMethod::GET : method == "PUT" ? HttpMethod::PUT : HttpMethod::OTHER;
+        case 4: return method == "POST" ? HttpMethod::POST : method == "HEAD" ? HttpMethod::HEAD : HttpMethod::OTHER;
+        case 5: return method == "PATCH" ? HttpMethod::PATCH : HttpMethod::OTHER;
+        case 6: return method == "DELETE" ? HttpMethod::DELETE : HttpMethod::OTHER;
+        case 7: return method == "OPTIONS" ? HttpMethod::OPTIONS : HttpMethod::OTHER;
+        default: return HttpMethod::OTHER;
+    }
+}
+
+using StaticHandler = HttpResponse (*)(const Request& request, Connection& conn);
+
+struct StaticRoute {
+    HttpMethod method;
+    string_view path;
+    StaticHandler handler;
+};
+
+// FNV-1a روی متد و مسیر با seed قابل تنظیم
+constexpr uint32_t route_hash(uint32_t seed, HttpMethod method, string_view path) {
+    uint32_t hash = (2166136261u ^ seed) * 16777619u;
+    hash = (hash ^ (uint32_t)method) * 16777619u;
+    for (char c : path) hash = (hash ^ (uint8_t)c) * 16777619u;
+    return hash;
+}
+
+// جدول perfect hash که کامپایلر می‌سازد: seedی پیدا می‌شود که هیچ دو مسیری در یک خانه نیفتند،
+// پس تطبیق هر درخواست یک hash، یک مقایسه و یک فراخوانی مستقیم هندلر است.
+// مسیر تکراری یا seed پیدا نشده خطای کامپایل می‌دهد.
+template <size_t N>
+struct StaticRouteTable {
+    static constexpr size_t SLOTS = [] {
+        size_t slots = 1;
+        while (slots < N * 4) slots <<= 1;
+        return slots;
+    }();
+
+    StaticRoute routes[N];
+    int slots[SLOTS];
+    uint32_t seed;
+
+    constexpr StaticRouteTable(const StaticRoute (&list)[N]) : routes{}, slots{}, seed(0) {
+        for (size_t i = 0; i < N; ++i) routes[i] = list[i];
+        for (seed = 1; seed < 100000; ++seed) {
+            bool collision = false;
+            for (size_t slot = 0; slot < SLOTS; ++slot) slots[slot] = -1;
+            for (size_t i = 0; i < N && !collision; ++i) {
+                size_t slot = route_hash(seed, routes[i].method, routes[i].path) & (SLOTS - 1);
+                if (slots[slot] != -1) collision = true;
+                else slots[slot] = (int)i;
+            }
+            if (!collision) return;
+        }
+        throw logic_error("No perfect hash seed found (duplicate static route?)");
+    }
+
+    // اندیس مسیر منطبق یا -1
+    int find(HttpMethod method, string_view path) const {
+        int index = slots[route_hash(seed, method, path) & (SLOTS - 1)];
+        if (index < 0 || routes[index].method != method || routes[index].path != path) return -1;
+        return index;
+    }
+};
+
+// switch تولیدشده روی اندیس مسیر: هر شاخه هندلر را مستقیم (و قابل inline) صدا می‌زند، بدون std::function
+template <const auto& Table, size_t... I>
+bool call_static_route(int index, const Request& request, Connection& conn, HttpResponse& response, index_sequence<I...>) {
+    return ((index == (int)I && (response = Table.routes[I].handler(request, conn), true)) || ...);
+}
+
+// اندیس مسیر اجرا شده یا -1
+template <const auto& Table>
+int dispatch_static_routes(const Request& request, Connection& conn, HttpResponse& response) {
+    int index = Table.find(parse_http_method(request.method), request.path);
+    if (index < 0) return -1;
+    constexpr size_t count = sizeof(Table.routes) / sizeof(Table.routes[0]);
+    return call_static_route<Table>(index, request, conn, response, make_index_sequence<count>()) ? index : -1;
+}
+
+using StaticDispatcher = int (*)(const Request& request, Connection& conn, HttpResponse& response);
+
+// مسیریاب مبتنی بر درخت radix فشرده (یک درخت برای هر متد).
+// الگوها: بخش ثابت، ":name" برای یک بخش از مسیر تا '/' بعدی و "*name" برای باقیمانده کل مسیر.
+// اولویت تطبیق: ثابت، سپس پارامتر، سپس catch-all؛ هزینه تطبیق به طول مسیر بستگی دارد نه تعداد مسیرها.
+class Router {
+private:
+    struct Node {
+        string label;                       // برچسب یال ثابت ورودی به این گره
+        vector<unique_ptr<Node>> children;  // فرزندان ثابت؛ اولین حرف برچسب‌ها یکتاست
+        string child_first_chars;           // اولین حرف برچسب هر فرزند، هم‌ترتیب با children
+        unique_ptr<Node> param_child;       // ":name"
+        unique_ptr<Node> catch_all_child;   // "*name" (همیشه آخرین بخش الگو)
+        string param_name;                  // نام پارامتر برای param_child و catch_all_child
+        HandlerFunc handler;
+        uint8_t route_id = 0;
+    };
+
+    vector<pair<string, unique_ptr<Node>>> trees; // متد -> ریشه درخت
+    StaticDispatcher static_dispatcher = nullptr; // مسیرهای بدون پارامتر که در زمان کامپایل معلوم‌اند
+    uint8_t static_route_base = 0;               // شناسه مسیر ثابت = static_route_base + اندیس + 1
+    vector<string> names;                         // "METHOD الگو" به ترتیب شناسه (اندیس = شناسه - 1)
+
+    uint8_t next_route_id(string name) {
+        if (names.size() >= UINT8_MAX) throw runtime_error("Too many routes for the access log route id: " + name);
+        names.push_back(move(name));
+        return (uint8_t)names.size();
+    }
+
+    Node* tree_for(string_view method, bool create) {
+        for (auto& tree : trees) {
+            if (tree.first == method) return tree.second.get();
+        }
+        if (!create) return nullptr;
+        trees.emplace_back(string(method), make_unique<Node>());
+        return trees.back().second.get();
+    }
+
+    // درج بخش ثابت با شکستن یال‌هایی که فقط در پیشوند مشترک‌اند
+    static Node* insert_static(Node* node, string_view text) {
+        while (!text.empty()) {
+            size_t index = node->child_first_chars.find(text[0]);
+            if (index == string::npos) {
+                node->children.push_back(make_unique<Node>());
+                node->child_first_chars.push_back(text[0]);
+                node->children.back()->label = string(text);
+                return node->children.back().get();
+            }
+
+            Node* child = node->children[index].get();
+            size_t common = 0;
+            while (common < child->label.length() && common < text.length() && child->label[common] == text[common]) ++common;
+
+            if (common < child->label.length()) {
+                unique_ptr<Node> middle = make_unique<Node>();
+                middle->label = child->label.substr(0, common);
+                child->label.erase(0, common);
+                middle->child_first_chars.push_back(child->label[0]);
+                middle->children.push_back(move(node->children[index]));
+                node->children[index] = move(middle);
+                child = node->children[index].get();
+            }
+            node = child;
+            text.remove_prefix(common);
+        }
+        return node;
+    }
+
+    static Node* insert_param(unique_ptr<Node>& slot, string_view name, const string& pattern) {
+        if (name.empty()) throw runtime_error("Route parameter without a name: " + pattern);
+        if (!slot) {
+            slot = make_unique<Node>();
+            slot->param_name = string(name);
+        } else if (slot->param_name != name) {
+            throw runtime_error("Conflicting route parameter names in: " + pattern);
+        }
+        return slot.get();
+    }
+
+    // تطبیق بازگشتی با عقب‌گرد؛ پارامترها بدون تخصیص حافظه به صورت string_view در request نوشته می‌شوند
+    static const Node* match(const Node* node, string_view path, Request& request) {
+        if (path.empty() && node->handler) return node;
+
+        if (!path.empty()) {
+            size_t index = node->child_first_chars.find(path[0]);
+            if (index != string::npos) {
+                const Node* child = node->children[index].get();
+                if (path.compare(0, child->label.length(), child->label) == 0) {
+                    const Node* found = match(child, path.substr(child->label.length()), request);
+                    if (found) return found;
+                }
+            }
+        }
+
+        if (node->param_child) {
+            size_t segment_end = min(path.find('/'), path.length());
+            if (segment_end > 0 && request.push_param(node->param_child->param_name, path.substr(0, segment_end))) {
+                const Node* found = match(node->param_child.get(), path.substr(segment_end), request);
+                if (found) return found;
+                request.pop_param();
+            }
+        }
+
+        if (node->catch_all_child && request.push_param(node->catch_all_child->param_name, path)) {
+            return node->catch_all_child.get();
+        }
+        return nullptr;
+    }
+
+public:
+    // مسیرهای ثابت پیش از درخت‌ها بررسی می‌شوند؛ تطبیق کامل ثابت در درخت هم بالاترین اولویت را دارد
+    template <const auto& Table>
+    void set_static_routes() {
+        static_dispatcher = dispatch_static_routes<Table>;
+        static_route_base = (uint8_t)names.size();
+        for (const StaticRoute& route : Table.routes) {
+            next_route_id(string(HTTP_METHOD_NAMES[(size_t)route.method]) + " " + string(route.path));
+        }
+    }
+
+    // نام مسیرها به ترتیب شناسه، برای جدول مسیر در سرآیند لاگ دسترسی
+    const vector<string>& route_names() const { return names; }
+
+    void register_route(const string& method, const string& pattern, HandlerFunc handler) {
+        Node* node = tree_for(method, true);
+        string_view rest = pattern;
+        size_t param_count = 0;
+
+        while (!rest.empty()) {
+            size_t special = rest.find_first_of(":*");
+            node = insert_static(node, rest.substr(0, special));
+            if (special == string_view::npos) break;
+
+            if (special > 0 && rest[special - 1] != '/') throw runtime_error("Route parameter must start a segment: " + pattern);
+            if (++param_count > Request::MAX_ROUTE_PARAMS) throw runtime_error("Too many route parameters: " + pattern);
+
+            if (rest[special] == '*') {
+                node = insert_param(node->catch_all_child, rest.substr(special + 1), pattern);
+                if (rest.substr(special + 1).find('/') != string_view::npos) throw runtime_error("Catch-all must be the last segment: " + pattern);
+                break;
+            }
+            size_t name_end = rest.find('/', special);
+            node = insert_param(node->param_child, rest.substr(special + 1, name_end == string_view::npos ? string_view::npos : name_end - special - 1), pattern);
+            rest = name_end == string_view::npos ? string_view() : rest.substr(name_end);
+        }
+        node->handler = move(handler);
+        node->route_id = next_route_id(method + " " + pattern);
+    }
+
+    HttpResponse route_request(Request& request, Connection& conn) {
+        request.clear_params();
+        request.route_id = 0;
+        HttpResponse response;
+        if (static_dispatcher) {
+            int index = static_dispatcher(request, conn, response);
+            if (index >= 0) {
+                request.route_id = (uint8_t)(static_route_base + index + 1);
+                return response;
+            }
+        }
+
+        const Node* root = tree_for(request.method, false);
+        const Node* found = root ? match(root, request.path, request) : nullptr;
+        if (found) {
+            request.route_id = found->route_id;
+            return found->handler(request, conn);
+        }
+
+        // پاسخ ۴۰۴
+        return build_http_response("<h1>404</h1><p>مسیر مورد نظر وجود ندارد.</p>", 404);
+    }
+};
+
+// ----------------------------------------------------------------------
+// --- ۲.۵. کش حافظه‌ای فایل‌های استاتیک (LRU + inotify) ---
+// ----------------------------------------------------------------------
+
+// پاسخ‌های کامل (هدر + بدنه) فایل‌های کوچک WEB_ROOT در حافظه نگه داشته می‌شوند تا مسیر داغ
+// (صفحه اصلی، css و js) اصلاً به فایل‌سیستم نرسد. تازگی داده‌ها با inotify روی WEB_ROOT تضمین می‌شود؛
+// اگر inotify در دسترس نباشد کش غیرفعال می‌ماند.
+class StaticFileCache {
+private:
+    struct Entry {
+        string path;
+        shared_ptr<const string> response;
+    };
+
+    mutex cache_mutex;
+    list<Entry> lru; // ابتدای لیست: جدیدترین استفاده
+    unordered_map<string, list<Entry>::iterator> index;
+    size_t total_bytes;
+    size_t max_bytes;
+    atomic<bool> enabled;
+    atomic<uint64_t> generation; // با هر تغییر فایل افزایش می‌یابد تا بارگذاری‌های هم‌زمانِ کهنه ذخیره نشوند
+
+    int inotify_fd;
+    unordered_map<int, string> watched_dirs; // wd -> مسیر پوشه
+    function<void(const string&)> change_listener;
+
+    void evict_locked() {
+        while (total_bytes > max_bytes && !lru.empty()) {
+            total_bytes -= lru.back().response->length();
+            index.erase(lru.back().path);
+            lru.pop_back();
+        }
+    }
+
+    void erase_locked(const string& path) {
+        auto it = index.find(path);
+        if (it == index.end()) return;
+        total_bytes -= it->second->response->length();
+        lru.erase(it->second);
+        index.erase(it);
+    }
+
+    void add_watch(const string& dir) {
+        int wd = inotify_add_watch(inotify_fd, dir.c_str(),
+                                   IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                   IN_CREATE | IN_DELETE_SELF | IN_ONLYDIR);
+        if (wd < 0) {
+            log_message(LogLevel::ERROR, "خطا در inotify_add_watch برای " + dir + ": " + strerror(errno));
+            return;
+        }
+        watched_dirs[wd] = dir;
+
+        DIR* d = opendir(dir.c_str());
+        if (!d) return;
+        struct dirent* ent;
+        while ((ent = readdir(d)) != NULL) {
+            string name = ent->d_name;
+            if (name != "." && name != ".." && ent->d_type == DT_DIR) {
+                add_watch(dir + "/" + name);
+            }
+        }
+        closedir(d);
+    }
+
+    void watch_loop() {
+        vector<char> buffer(64 * 1024);
+        while (true) {
+            long length = read(inotify_fd, buffer.data(), buffer.size());
+            if (length < 0) {
+                if (errno == EINTR) continue;
+                log_message(LogLevel::ERROR, "خطا در خواندن inotify؛ کش فایل‌های استاتیک غیرفعال شد: " + string(strerror(errno)));
+                enabled = false;
+                clear();
+                return;
+            }
+            for (long offset = 0; offset < length;) {
+                const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(buffer.data() + offset);
+                offset += sizeof(struct inotify_event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW) {
+                    clear(); // رویدادها از دست رفته‌اند؛ امن‌ترین کار خالی کردن کل کش است
+                    continue;
+                }
+                auto dir = watched_dirs.find(event->wd);
+                if (dir == watched_dirs.end()) continue;
+                if (event->mask & IN_IGNORED) {
+                    watched_dirs.erase(dir);
+                    continue;
+                }
+                string path = event->len > 0 ? dir->second + "/" + event->name : dir->second;
+                if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && (event->mask & IN_ISDIR)) {
+                    add_watch(path);
+                }
+                if (event->mask & (IN_ISDIR | IN_DELETE_SELF)) {
+                    clear(); // تغییر پوشه می‌تواند چندین مسیر کش‌شده را تحت تأثیر قرار دهد
+                } else {
+                    // نسخه‌های فشرده کش‌شده هم با تغییر فایل اصلی قدیمی می‌شوند
+                    invalidate(path);
+                    invalidate(path + ".gz");
+                    invalidate(path + ".br");
+                    if ((event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && change_listener) change_listener(path);
+                }
+            }
+        }
+    }
+
+public:
+    explicit StaticFileCache(size_t max_cache_bytes)
+        : total_bytes(0), max_bytes(max_cache_bytes), enabled(false), generation(0), inotify_fd(-1) {}
+
+    // شروع پایش WEB_ROOT در یک نخ پس‌زمینه؛ فقط در صورت موفقیت کش فعال می‌شود
+    bool start(const string& root) {
+        if (max_bytes == 0) return false;
+        inotify_fd = inotify_init1(IN_CLOEXEC);
+        if (inotify_fd < 0) {
+            log_message(LogLevel::WARN, "inotify در دسترس نیست؛ کش فایل‌های استاتیک غیرفعال است: " + string(strerror(errno)));
+            return false;
+        }
+        add_watch(root);
+        if (watched_dirs.empty()) return false;
+        enabled = true;
+        thread(&StaticFileCache::watch_loop, this).detach();
+        return true;
+    }
+
+    bool is_enabled() const { return enabled; }
+
+    // فراخوانی پس از پایان نوشتن یک فایل (مثلاً برای ساخت دوباره نسخه‌های فشرده)؛ باید پیش از start تنظیم شود
+    void set_change_listener(function<void(const string&)> listener) {
+        change_listener = move(listener);
+    }
+
+    uint64_t current_generation() const { return generation.load(); }
+
+    shared_ptr<const string> get(const string& path) {
+        if (!enabled) return nullptr;
+        lock_guard<mutex> lock(cache_mutex);
+        auto it = index.find(path);
+        if (it == index.end()) return nullptr;
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->response;
+    }
+
+    // ذخیره پاسخ؛ اگر از زمان شروع بارگذاری (loaded_generation) فایلی تغییر کرده باشد ذخیره نمی‌شود
+    void put(const string& path, shared_ptr<const string> response, uint64_t loaded_generation) {
+        if (!enabled || response->length() > max_bytes) return;
+        lock_guard<mutex> lock(cache_mutex);
+        if (generation.load() != loaded_generation) return;
+        erase_locked(path);
+        lru.push_front(Entry{path, response});
+        index[path] = lru.begin();
+        total_bytes += response->length();
+        evict_locked();
+    }
+
+    void invalidate(const string& path) {
+        lock_guard<mutex> lock(cache_mutex);
+        ++generation;
+        erase_locked(path);
+    }
+
+    void clear() {
+        lock_guard<mutex> lock(cache_mutex);
+        ++generation;
+        lru.clear();
+        index.clear();
+        total_bytes = 0;
+    }
+};
+
+StaticFileCache static_cache(STATIC_CACHE_MAX_BYTES);
+
+// فقط مسیرهای نرمال داخل WEB_ROOT کش می‌شوند تا کلید کش با مسیر رویدادهای inotify یکی باشد
+bool is_cacheable_static_path(const string& full_path) {
+    return full_path.compare(0, WEB_ROOT.length() + 1, WEB_ROOT + "/") == 0 &&
+           full_path.find("/.") == string::npos && full_path.find("//") == string::npos;
+}
+
+// --- ۳. توابع کمکی پروتکلی (پروتکل و I/O) ---
+string sanitize_path(string path) {
+    size_t pos = path.find("..");
+    while (pos != string::npos) {
+        path.replace(pos, 2, ".");
+        pos = path.find("..", pos);
+    }
+    if (path.empty() || path[0] != '/') {
+        path.insert(0, "/");
+    }
+    return path;
+}
+
+// خط وضعیت کامل برای هر کد؛ رشته‌های ثابت که مستقیم در iovec قرار می‌گیرند
+string_view status_line(int status_code) {
+    switch (status_code) {
+        case 200: return "HTTP/1.1 200 OK\r\n";
+        case 201: return "HTTP/1.1 201 Created\r\n";
+        case 206: return "HTTP/1.1 206 Partial Content\r\n";
+        case 304: return "HTTP/1.1 304 Not Modified\r\n";
+        case 400: return "HTTP/1.1 400 Bad Request\r\n";
+        case 403: return "HTTP/1.1 403 Forbidden\r\n";
+        case 404: return "HTTP/1.1 404 Not Found\r\n";
+        case 413: return "HTTP/1.1 413 Payload Too Large\r\n";
+        case 416: return "HTTP/1.1 416 Range Not Satisfiable\r\n";
+        case 500: return "HTTP/1.1 500 Internal Server Error\r\n";
+        case 501: return "HTTP/1.1 501 Not Implemented\r\n";
+        case 503: return "HTTP/1.1 503 Service Unavailable\r\n";
+        default: return "HTTP/1.1 500 Unknown\r\n";
+    }
+}
+
+HttpResponse build_http_response(string content, int status_code, string_view content_type) {
+    HttpResponse response;
+    response.status_code = status_code;
+    response.content_type = content_type;
+    response.body = move(content);
+    return response;
+}
+
+// متن‌ها و JSON خروجی ما UTF-8 است؛ charset فقط وقتی اضافه می‌شود که نوع محتوا خودش آن را نداشته باشد
+static bool needs_utf8_charset(string_view content_type) {
+    return (content_type.substr(0, 5) == "text/" || content_type == "application/json") &&
+           content_type.find("charset") == string_view::npos;
+}
+
+// هدر Connection مطابق تصمیم ماندگاری اتصال برای پاسخ جاری
+static string_view connection_header(const Connection& conn) {
+    static const string_view KEEP_ALIVE = "Connection: keep-alive\r\n";
+    static const string_view CLOSE = "Connection: close\r\n";
+    return conn.keep_alive ? KEEP_ALIVE : CLOSE;
+}
+
+// خط وضعیت پاسخ از پیش ساخته‌شده به همراه Date و Connection؛ status_end طول خط وضعیت در response است.
+// این دو در پاسخ‌های کش‌شده نگه داشته نمی‌شوند: Date کهنه می‌شود و Connection به هر اتصال بستگی دارد.
+static string prebuilt_response_head(Connection& conn, string_view response, size_t& status_end) {
+    // "HTTP/1.1 200 ..." — کد وضعیت برای لاگ دسترسی
+    if (response.length() > 12) from_chars(response.data() + 9, response.data() + 12, conn.response_status);
+    status_end = response.find("\r\n");
+    if (status_end == string_view::npos) {
+        status_end = 0;
+        return string();
+    }
+    status_end += 2;
+    const ClockSnapshot& clock = server_clock.now();
+    string_view connection = connection_header(conn);
+    string head;
+    head.reserve(status_end + clock.date_header_length + connection.length());
+    head.append(response.data(), status_end);
+    head.append(clock.date_header, clock.date_header_length);
+    head += connection;
+    return head;
+}
+
+// ارسال پاسخ کش‌شده: فقط خط وضعیت و هدرهای وابسته به زمان و اتصال ساخته می‌شوند و بقیه پاسخ
+// (هدرهای ثابت و بدنه) از همان حافظه کش بدون کپی ارسال می‌شود
+void send_prebuilt_response(Connection& conn, const shared_ptr<const string>& response) {
+    size_t status_end;
+    conn.send(prebuilt_response_head(conn, *response, status_end));
+    conn.send_shared(response, status_end, response->length() - status_end);
+}
+
+// ارسال هدرهای از پیش ساخته‌شده یک‌باره (مثلاً هدر فایل یا 304)
+void send_prebuilt_response(Connection& conn, string response) {
+    size_t status_end;
+    string head = prebuilt_response_head(conn, response, status_end);
+    response.replace(0, status_end, head);
+    conn.send(move(response));
+}
+
+// ساخت هدرهای پاسخ در یک رشته (خط وضعیت، Date، نوع محتوا و Content-Length که با to_chars نوشته
+// می‌شود)؛ بدنه بدون کپی پشت آن در صف قرار می‌گیرد
+void send_response(Connection& conn, HttpResponse response) {
+    static const string_view CONTENT_TYPE = "Content-Type: ";
+    static const string_view CHARSET = "; charset=utf-8";
+    static const string_view CONTENT_LENGTH = "\r\nContent-Length: ";
+    static const string_view CRLF = "\r\n";
+
+    char length_text[24];
+    char* length_end = to_chars(length_text, length_text + sizeof(length_text), response.body.length()).ptr;
+
+    string_view status = status_line(response.status_code);
+    const ClockSnapshot& clock = server_clock.now();
+    string_view connection = connection_header(conn);
+    conn.response_status = response.status_code;
+
+    string head;
+    head.reserve(160 + response.content_type.length() + response.extra_headers.length());
+    head += status;
+    head.append(clock.date_header, clock.date_header_length);
+    head += CONTENT_TYPE;
+    head += response.content_type;
+    if (needs_utf8_charset(response.content_type)) head += CHARSET;
+    head += CONTENT_LENGTH;
+    head.append(length_text, length_end);
+    head += CRLF;
+    head += connection;
+    head += response.extra_headers;
+    head += CRLF;
+    conn.send(move(head));
+    conn.send(move(response.body));
+}
+
+// پاسخ جریانی با Transfer-Encoding: chunked برای بدنه‌هایی که اندازه‌شان از پیش معلوم نیست.
+// هندلر در buffer() می‌نویسد و با flush_if_full() هر STREAM_CHUNK_SIZE بایت به صورت یک فریم
+// chunk به صف خروجی اضافه می‌شود؛ همراه با ResponseProducer حافظه مصرفی مستقل از اندازه کل پاسخ
+// است. هدرها همراه اولین فریم و فریم پایانی همراه آخرین تکه داده ارسال می‌شوند. کلاینت HTTP/1.0 که
+// chunked نمی‌فهمد بدنه خام می‌گیرد و پایان آن با بستن اتصال مشخص می‌شود (keep_alive خاموش می‌شود).
+class ChunkedResponseWriter {
+private:
+    Connection& conn;
+    int status_code;
+    string_view content_type;
+    bool chunked;
+    bool headers_sent = false;
+    string data;
+
+    void send(bool last) {
+        static const string_view CONTENT_TYPE = "Content-Type: ";
+        static const string_view CHARSET = "; charset=utf-8";
+        static const string_view TRANSFER_ENCODING = "\r\nTransfer-Encoding: chunked";
+        static const string_view CRLF = "\r\n";
+        static const string_view LAST_CHUNK = "0\r\n\r\n";
+
+        // هدرها و خط اندازه فریم در یک رشته؛ داده فریم خودش منتقل می‌شود و بافر تازه می‌گیریم
+        string head;
+        if (!headers_sent) {
+            string_view status = status_line(status_code);
+            const ClockSnapshot& clock = server_clock.now();
+            conn.response_status = status_code;
+            if (!chunked) conn.keep_alive = false;
+            head += status;
+            head.append(clock.date_header, clock.date_header_length);
+            head += CONTENT_TYPE;
+            head += content_type;
+            if (needs_utf8_charset(content_type)) head += CHARSET;
+            if (chunked) head += TRANSFER_ENCODING;
+            head += CRLF;
+            head += connection_header(conn);
+            head += CRLF;
+            headers_sent = true;
+        }
+        string tail;
+        if (chunked && !data.empty()) {
+            char size_line[20];
+            char* size_end = to_chars(size_line, size_line + sizeof(size_line) - 2, data.length(), 16).ptr;
+            *size_end++ = '\r';
+            *size_end++ = '\n';
+            head.append(size_line, size_end);
+            tail += CRLF;
+        }
+        if (chunked && last) tail += LAST_CHUNK;
+
+        conn.send(move(head));
+        conn.send(move(data));
+        conn.send(move(tail));
+        data = string();
+        if (!last) data.reserve(STREAM_CHUNK_SIZE + 1024);
+    }
+
+public:
+    ChunkedResponseWriter(Connection& connection, const Request& request, int status, string_view type)
+        : conn(connection), status_code(status), content_type(type), chunked(request.version != "HTTP/1.0") {
+        data.reserve(STREAM_CHUNK_SIZE + 1024);
+    }
+
+    string& buffer() { return data; }
+
+    // فریم وقتی بافر پر شده است به صف خروجی اضافه می‌شود
+    void flush_if_full() {
+        if (data.length() >= STREAM_CHUNK_SIZE) send(false);
+    }
+
+    // ارسال باقی‌مانده و فریم پایانی
+    void finish() { send(true); }
+};
+
+// هدر پاسخ فایل؛ extra_headers (مثل Content-Range) بدون تغییر پیش از خط خالی درج می‌شود.
+// Connection را send_prebuilt_response بر اساس اتصال اضافه می‌کند تا نتیجه قابل کش باشد.
+string build_http_response_cacheable(long content_length, const string& content_type, const string& extra_headers = "", bool partial = false) {
+    char length_text[24];
+    char* length_end = to_chars(length_text, length_text + sizeof(length_text), content_length).ptr;
+
+    string response;
+    response.reserve(192 + content_type.length() + extra_headers.length());
+    response += status_line(partial ? 206 : 200);
+    response += "Content-Type: ";
+    response += content_type;
+    response += "\r\nContent-Length: ";
+    response.append(length_text, length_end);
+    response += "\r\nCache-Control: public, max-age=604800\r\n" // کش کردن برای یک هفته
+                "Accept-Ranges: bytes\r\n";
+    response += extra_headers;
+    response += "\r\n";
+    return response;
+}
+
+// تاریخ به قالب HTTP (IMF-fixdate)، مثلاً: Sun, 06 Nov 1994 08:49:37 GMT
+string format_http_date(time_t t) {
+    struct tm tm_utc;
+    gmtime_r(&t, &tm_utc);
+    char buffer[64];
+    strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm_utc);
+    return buffer;
+}
+
+// خواندن تاریخ HTTP؛ در صورت قالب نامعتبر -1 برمی‌گرداند
+time_t parse_http_date(string_view value) {
+    char text[64];
+    if (value.length() >= sizeof(text)) return -1;
+    memcpy(text, value.data(), value.length());
+    text[value.length()] = '\0';
+    struct tm tm_utc = {};
+    const char* end = strptime(text, "%a, %d %b %Y %H:%M:%S GMT", &tm_utc);
+    if (end == nullptr || *end != '\0') return -1;
+    return timegm(&tm_utc);
+}
+
+// ----------------------------------------------------------------------
+// --- اعتبارسنج‌ها و GET شرطی (ETag / Last-Modified / 304) ---
+// ----------------------------------------------------------------------
+
+// ETag قوی از inode، اندازه و زمان تغییر (با دقت نانوثانیه)؛ بدون خواندن محتوای فایل
+string make_etag(const struct stat& file_stat) {
+    char buffer[96];
+    snprintf(buffer, sizeof(buffer), "\"%llx-%llx-%llx.%lx\"",
+             (unsigned long long)file_stat.st_ino, (unsigned long long)file_stat.st_size,
+             (unsigned long long)file_stat.st_mtim.tv_sec, (unsigned long)file_stat.st_mtim.tv_nsec);
+    return buffer;
+}
+
+// If-None-Match با مقایسه ضعیف (W/ نادیده گرفته می‌شود) و * برای هر نسخه موجود
+static bool etag_list_matches(string_view header_value, const string& etag) {
+    bool matched = false;
+    for_each_list_item(header_value, [&](string_view candidate) {
+        if (candidate.substr(0, 2) == "W/") candidate.remove_prefix(2);
+        matched = candidate == "*" || candidate == etag;
+        return !matched;
+    });
+    return matched;
+}
+
+// آیا نسخه کلاینت هنوز معتبر است؟ If-None-Match بر If-Modified-Since مقدم است (RFC 9110)
+bool is_not_modified(const Request& request, const string& etag, time_t mtime) {
+    if (request.has_header(KnownHeader::IF_NONE_MATCH)) {
+        return etag_list_matches(request.header(KnownHeader::IF_NONE_MATCH), etag);
+    }
+    if (request.has_header(KnownHeader::IF_MODIFIED_SINCE)) {
+        time_t since = parse_http_date(request.header(KnownHeader::IF_MODIFIED_SINCE));
+        return since != -1 && mtime <= since;
+    }
+    return false;
+}
+
+// پاسخ 304 فقط هدر است: همان اعتبارسنج‌ها و Cache-Control، بدون بدنه (Connection با send_prebuilt_response)
+string build_http_response_not_modified(const string& validator_headers) {
+    string response(status_line(304));
+    response += "Cache-Control: public, max-age=604800\r\n";
+    response += validator_headers;
+    response += "\r\n";
+    return response;
+}
+
+// ----------------------------------------------------------------------
+// --- پشتیبانی از Range (دانلود ادامه‌دار و جابه‌جایی در ویدیو) ---
+// ----------------------------------------------------------------------
+
+struct ByteRange {
+    long start;
+    long end; // شامل خود end
+};
+
+enum class RangeResult { IGNORE, SATISFIABLE, UNSATISFIABLE };
+
+// خواندن یک عدد نامنفی ده‌دهی؛ سرریز یا کاراکتر نامعتبر خطا حساب می‌شود
+static bool parse_range_number(string_view text, long& value) {
+    if (text.empty() || text.length() > 18) return false;
+    value = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') return false;
+        value = value * 10 + (c - '0');
+    }
+    return true;
+}
+
+// تجزیه هدر Range طبق RFC 9110؛ هدر نامعتبر نادیده گرفته می‌شود (پاسخ کامل ۲۰۰)
+RangeResult parse_range_header(string_view value, long file_size, vector<ByteRange>& ranges) {
+    ranges.clear();
+    if (value.length() < 6 || !equals_ignore_case(value.substr(0, 6), "bytes=")) return RangeResult::IGNORE;
+
+    size_t spec_count = 0;
+    bool valid = true;
+    for_each_list_item(value.substr(6), [&](string_view spec) {
+        if (++spec_count > MAX_BYTE_RANGES) return valid = false;
+
+        size_t dash = spec.find('-');
+        if (dash == string_view::npos) return valid = false;
+        string_view first = spec.substr(0, dash);
+        string_view last = spec.substr(dash + 1);
+
+        if (first.empty()) {
+            // suffix-range: N بایت آخر فایل
+            long suffix_length;
+            if (!parse_range_number(last, suffix_length)) return valid = false;
+            if (suffix_length > 0 && file_size > 0) {
+                ranges.push_back({max(0L, file_size - suffix_length), file_size - 1});
+            }
+            return true;
+        }
+
+        long start, end = file_size - 1;
+        if (!parse_range_number(first, start)) return valid = false;
+        if (!last.empty()) {
+            if (!parse_range_number(last, end) || end < start) return valid = false;
+            end = min(end, file_size - 1);
+        }
+        if (start < file_size) ranges.push_back({start, end}); // بازه خارج از فایل کنار گذاشته می‌شود
+        return true;
+    });
+
+    if (!valid || spec_count == 0) return RangeResult::IGNORE;
+    return ranges.empty() ? RangeResult::UNSATISFIABLE : RangeResult::SATISFIABLE;
+}
+
+// If-Range: فقط وقتی اعتبارسنج با نسخه فعلی فایل یکی باشد Range اجرا می‌شود، وگرنه کل فایل
+bool if_range_matches(const Request& request, const string& etag, const string& last_modified) {
+    if (!request.has_header(KnownHeader::IF_RANGE)) return true;
+    string_view validator = request.header(KnownHeader::IF_RANGE);
+    // مقایسه قوی: ETag ضعیف (W/) هرگز منطبق نیست و تاریخ باید دقیقاً برابر باشد
+    if (!validator.empty() && validator[0] == '"') return validator == etag;
+    return validator == last_modified;
+}
+
+// ارسال بازه‌ها: یک بازه با 206 ساده، چند بازه با multipart/byteranges؛ بدنه‌ها با send_file می‌روند
+void send_file_ranges(Connection& conn, const shared_ptr<OpenFile>& file, long file_size, const string& mime_type, const string& validator_headers, const vector<ByteRange>& ranges) {
+    if (ranges.size() == 1) {
+        const ByteRange& range = ranges[0];
+        string extra = validator_headers + "Content-Range: bytes " + to_string(range.start) + "-" + to_string(range.end) + "/" + to_string(file_size) + "\r\n";
+        send_prebuilt_response(conn, build_http_response_cacheable(range.end - range.start + 1, mime_type, extra, true));
+        conn.send_file(file, range.start, range.end - range.start + 1);
+        return;
+    }
+
+    static atomic<uint64_t> boundary_counter{0};
+    char boundary[48];
+    snprintf(boundary, sizeof(boundary), "byteranges_%lx_%llx", (unsigned long)server_clock.now().now,
+             (unsigned long long)boundary_counter.fetch_add(1, memory_order_relaxed));
+
+    // طول کل بدنه باید پیش از ارسال معلوم باشد، پس هدر هر بخش از قبل ساخته می‌شود
+    vector<string> part_headers;
+    long content_length = 0;
+    for (const ByteRange& range : ranges) {
+        string part = string("\r\n--") + boundary + "\r\n"
+                      "Content-Type: " + mime_type + "\r\n"
+                      "Content-Range: bytes " + to_string(range.start) + "-" + to_string(range.end) + "/" + to_string(file_size) + "\r\n\r\n";
+        content_length += part.length() + (range.end - range.start + 1);
+        part_headers.push_back(move(part));
+    }
+    string closing = string("\r\n--") + boundary + "--\r\n";
+    content_length += closing.length();
+
+    send_prebuilt_response(conn, build_http_response_cacheable(content_length, string("multipart/byteranges; boundary=") + boundary, validator_headers, true));
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        conn.send(move(part_headers[i]));
+        conn.send_file(file, ranges[i].start, ranges[i].end - ranges[i].start + 1);
+    }
+    conn.send(move(closing));
+}
+
+string get_mime_type(const string& file_path) {
+    size_t dot_pos = file_path.find_last_of('.');
+    if (dot_pos == string::npos) return "text/plain"; 
+
+    string ext = file_path.substr(dot_pos + 1);
+
+    if (ext == "html" || ext == "htm") return "text/html";
+    if (ext == "css") return "text/css";
+    if (ext == "js") return "application/javascript";
+    if (ext == "jpg" || ext == "jpeg") return "image/jpeg";
+    if (ext == "png") return "image/png";
+    if (ext == "gif") return "image/gif";
+    if (ext == "ico") return "image/x-icon";
+    if (ext == "mp4") return "video/mp4";
+    if (ext == "json") return "application/json";
+    
+    return "application/octet-stream";
+}
+
+// ----------------------------------------------------------------------
+// --- نسخه‌های پیش‌فشرده (gzip / brotli) برای فایل‌های متنی WEB_ROOT ---
+// ----------------------------------------------------------------------
+
+struct ContentCoding {
+    const char* name;      // مقدار Content-Encoding
+    const char* extension; // پسوند فایل هم‌نام کنار فایل اصلی
+};
+
+const ContentCoding CONTENT_CODINGS[] = {{"br", ".br"}, {"gzip", ".gz"}};
+
+bool is_compressible_mime(const string& mime_type) {
+    return mime_type.rfind("text/", 0) == 0 || mime_type == "application/javascript" ||
+           mime_type == "application/json" || mime_type == "image/svg+xml";
+}
+
+bool is_precompressed_variant(const string& path) {
+    for (const ContentCoding& coding : CONTENT_CODINGS) {
+        size_t ext_length = strlen(coding.extension);
+        if (path.length() > ext_length && path.compare(path.length() - ext_length, ext_length, coding.extension) == 0) return true;
+    }
+    return false;
+}
+
+// مقایسه زمان تغییر با دقت نانوثانیه؛ دقت ثانیه برای فایلی که دو بار در یک ثانیه نوشته شود کافی نیست
+bool modified_before(const struct stat& a, const struct stat& b) {
+    if (a.st_mtim.tv_sec != b.st_mtim.tv_sec) return a.st_mtim.tv_sec < b.st_mtim.tv_sec;
+    return a.st_mtim.tv_nsec < b.st_mtim.tv_nsec;
+}
+
+bool gzip_compress(const string& input, string& output) {
+    z_stream stream = {};
+    // windowBits 15 + 16 یعنی قالب gzip به‌جای zlib خام
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+    output.resize(deflateBound(&stream, input.length()));
+    stream.next_in = (Bytef*)input.data();
+    stream.avail_in = input.length();
+    stream.next_out = (Bytef*)&output[0];
+    stream.avail_out = output.length();
+    int result = deflate(&stream, Z_FINISH);
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+    return result == Z_STREAM_END;
+}
+
+bool brotli_compress(const string& input, string& output) {
+    size_t encoded_size = BrotliEncoderMaxCompressedSize(input.length());
+    if (encoded_size == 0) return false;
+    output.resize(encoded_size);
+    if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               input.length(), (const uint8_t*)input.data(), &encoded_size, (uint8_t*)&output[0])) {
+        return false;
+    }
+    output.resize(encoded_size);
+    return true;
+}
+
+// ساخت نسخه‌های .gz و .br یک فایل؛ نسخه‌ای که از فایل اصلی جدیدتر است دوباره ساخته نمی‌شود
+void precompress_file(const string& path) {
+    if (is_precompressed_variant(path) || path.find("/.") != string::npos) return;
+    if (!is_compressible_mime(get_mime_type(path))) return;
+
+    struct stat source_stat;
+    if (stat(path.c_str(), &source_stat) != 0 || !S_ISREG(source_stat.st_mode)) return;
+    if ((size_t)source_stat.st_size < PRECOMPRESS_MIN_FILE || (size_t)source_stat.st_size > PRECOMPRESS_MAX_FILE) return;
+
+    string content;
+    for (const ContentCoding& coding : CONTENT_CODINGS) {
+        string variant_path = path + coding.extension;
+        struct stat variant_stat;
+        if (stat(variant_path.c_str(), &variant_stat) == 0 && !modified_before(variant_stat, source_stat)) continue;
+
+        if (content.empty()) {
+            ifstream source(path, ios::binary);
+            content.assign(istreambuf_iterator<char>(source), istreambuf_iterator<char>());
+            if (content.length() != (size_t)source_stat.st_size) return; // فایل در حال نوشتن است؛ رویداد بعدی دوباره تلاش می‌کند
+        }
+
+        string compressed;
+        bool ok = coding.extension == string(".br") ? brotli_compress(content, compressed) : gzip_compress(content, compressed);
+        if (!ok || compressed.length() >= content.length()) {
+            unlink(variant_path.c_str()); // فشرده‌سازی سودی ندارد؛ نسخه قدیمی هم نباید بماند
+            continue;
+        }
+
+        // نوشتن در فایل موقت و rename تا هیچ درخواستی نسخه نیمه‌کاره را نبیند؛ نام نقطه‌دار است تا
+        // static_file_get_handler آن را سرو نکند (حتی اگر پس از کرش سرور باقی بماند)
+        size_t slash = path.rfind('/');
+        string temp_path = path.substr(0, slash + 1) + "." + path.substr(slash + 1) + ".precompress.tmp";
+        {
+            ofstream out(temp_path, ios::binary | ios::trunc);
+            out.write(compressed.data(), compressed.length());
+            if (!out) {
+                out.close();
+                unlink(temp_path.c_str());
+                log_message(LogLevel::ERROR, "خطا در نوشتن نسخه فشرده " + variant_path);
+                continue;
+            }
+        }
+        if (rename(temp_path.c_str(), variant_path.c_str()) != 0) unlink(temp_path.c_str());
+    }
+}
+
+void precompress_tree(const string& dir) {
+    DIR* d = opendir(dir.c_str());
+    if (!d) return;
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL) {
+        string name = ent->d_name;
+        if (name.empty() || name[0] == '.') continue;
+        string path = dir + "/" + name;
+        if (ent->d_type == DT_DIR) precompress_tree(path);
+        else precompress_file(path);
+    }
+    closedir(d);
+}
+
+// صف پس‌زمینه فشرده‌سازی: ساخت اولیه کل WEB_ROOT و سپس فایل‌هایی که inotify گزارش می‌دهد
+class Precompressor {
+private:
+    mutex queue_mutex;
+    condition_variable queue_cv;
+    deque<string> queue;
+
+    void worker_loop() {
+        while (true) {
+            string path;
+            {
+                unique_lock<mutex> lock(queue_mutex);
+                queue_cv.wait(lock, [this] { return !queue.empty(); });
+                path = move(queue.front());
+                queue.pop_front();
+            }
+            precompress_file(path);
+        }
+    }
+
+public:
+    void start(const string& root) {
+        thread([this, root] {
+            precompress_tree(root);
+            log_message("نسخه‌های پیش‌فشرده (gzip/brotli) فایل‌های " + root + " آماده شد.");
+            worker_loop();
+        }).detach();
+    }
+
+    void schedule(const string& path) {
+        if (is_precompressed_variant(path)) return;
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            if (find(queue.begin(), queue.end(), path) != queue.end()) return;
+            queue.push_back(path);
+        }
+        queue_cv.notify_one();
+    }
+};
+
+Precompressor precompressor;
+
+// qvalue طبق RFC 9110: 0 تا 1 با حداکثر سه رقم اعشار
+static double parse_qvalue(string_view text) {
+    if (text.empty() || (text[0] != '0' && text[0] != '1')) return 0;
+    double value = text[0] - '0';
+    if (text.length() > 1 && text[1] == '.') {
+        double scale = 0.1;
+        for (size_t i = 2; i < text.length() && i < 5 && text[i] >= '0' && text[i] <= '9'; ++i, scale /= 10) {
+            value += (text[i] - '0') * scale;
+        }
+    }
+    return min(value, 1.0);
+}
+
+// کدگذاری‌های قابل قبول کلاینت به ترتیب ترجیح (q بیشتر؛ در تساوی br بر gzip مقدم است)
+// خروجی در result نوشته می‌شود و تعداد کدگذاری‌های قابل استفاده برمی‌گردد
+size_t negotiate_content_codings(const Request& request, const ContentCoding* result[2]) {
+    if (!request.has_header(KnownHeader::ACCEPT_ENCODING)) return 0;
+
+    double qualities[2] = {-1, -1};
+    double wildcard = -1;
+    for_each_list_item(request.header(KnownHeader::ACCEPT_ENCODING), [&](string_view item) {
+        size_t semicolon = item.find(';');
+        string_view coding = item.substr(0, semicolon);
+        coding = coding.substr(0, coding.find_last_not_of(" \t") + 1);
+
+        double quality = 1.0;
+        if (semicolon != string_view::npos) {
+            size_t q_pos = item.find("q=", semicolon);
+            if (q_pos != string_view::npos) {
+                quality = parse_qvalue(item.substr(q_pos + 2));
+            }
+        }
+        if (coding == "*") wildcard = quality;
+        for (size_t i = 0; i < 2; ++i) {
+            if (equals_ignore_case(coding, CONTENT_CODINGS[i].name)) qualities[i] = quality;
+        }
+        return true;
+    });
+    size_t count = 0;
+    for (size_t i = 0; i < 2; ++i) {
+        if (qualities[i] < 0) qualities[i] = wildcard;
+        if (qualities[i] > 0) result[count++] = &CONTENT_CODINGS[i];
+    }
+    if (count == 2 && qualities[1] > qualities[0]) swap(result[0], result[1]);
+    return count;
+}
+
+// ارسال یک نمایش مشخص از فایل (اصلی یا فشرده)؛ اگر فایل قابل استفاده نباشد چیزی ارسال نمی‌شود و false برمی‌گردد.
+// برای نسخه فشرده، source_path فایل اصلی است و نسخه قدیمی‌تر از آن نادیده گرفته می‌شود.
+bool send_file_representation(Connection& conn, const string& file_path, const string& mime_type,
+                              const string& representation_headers, const Request& request,
+                              const string* source_path) {
+    bool has_range = request.has_header(KnownHeader::RANGE);
+    // درخواست شرطی به اعتبارسنج‌های فعلی فایل نیاز دارد، پس از کش پاسخ کامل رد می‌شود
+    bool conditional = request.has_header(KnownHeader::IF_NONE_MATCH) || request.has_header(KnownHeader::IF_MODIFIED_SINCE);
+    bool cacheable = static_cache.is_enabled() && is_cacheable_static_path(file_path);
+    uint64_t cache_generation = static_cache.current_generation();
+    if (cacheable && !has_range && !conditional) {
+        shared_ptr<const string> cached = static_cache.get(file_path);
+        if (cached) {
+            send_prebuilt_response(conn, cached);
+            return true;
+        }
+    }
+
+    int file_fd = open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat file_stat;
+    
+    if (file_fd < 0 || fstat(file_fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        if (file_fd >= 0) close(file_fd);
+        return false;
+    }
+    // از اینجا فایل متعلق به صف خروجی است و پس از ارسال آخرین بازه‌اش بسته می‌شود
+    shared_ptr<OpenFile> file = make_shared<OpenFile>(file_fd);
+    if (source_path) {
+        struct stat source_stat;
+        if (stat(source_path->c_str(), &source_stat) != 0 || modified_before(file_stat, source_stat)) {
+            return false;
+        }
+    }
+    
+    long file_size = file_stat.st_size;
+    string last_modified = format_http_date(file_stat.st_mtime);
+    string etag = make_etag(file_stat);
+    string validator_headers = representation_headers + "ETag: " + etag + "\r\nLast-Modified: " + last_modified + "\r\n";
+
+    if (conditional && is_not_modified(request, etag, file_stat.st_mtime)) {
+        send_prebuilt_response(conn, build_http_response_not_modified(validator_headers));
+        return true;
+    }
+
+    if (has_range && if_range_matches(request, etag, last_modified)) {
+        vector<ByteRange> ranges;
+        RangeResult result = parse_range_header(request.header(KnownHeader::RANGE), file_size, ranges);
+        if (result == RangeResult::UNSATISFIABLE) {
+            HttpResponse response = build_http_response("", 416, mime_type);
+            // Content-Range: bytes */size به کلاینت اندازه واقعی فایل را می‌گوید
+            response.extra_headers = "Content-Range: bytes */" + to_string(file_size) + "\r\n";
+            send_response(conn, move(response));
+            return true;
+        }
+        if (result == RangeResult::SATISFIABLE) {
+            send_file_ranges(conn, file, file_size, mime_type, validator_headers, ranges);
+            return true;
+        }
+    }
+
+    string response_headers = build_http_response_cacheable(file_size, mime_type, validator_headers);
+
+    // فایل کوچک: پاسخ کامل یک‌بار ساخته، در کش ذخیره و با یک ارسال فرستاده می‌شود
+    if (cacheable && (size_t)file_size <= STATIC_CACHE_MAX_FILE) {
+        string response = response_headers;
+        response.resize(response_headers.length() + file_size);
+        ssize_t bytes_read = pread(file_fd, &response[response_headers.length()], file_size, 0);
+        if (bytes_read != file_size) {
+            send_response(conn, build_http_response("<h1>500</h1><p>خطا در خواندن فایل.</p>", 500));
+            return true;
+        }
+        shared_ptr<const string> shared_response = make_shared<const string>(move(response));
+        static_cache.put(file_path, shared_response, cache_generation);
+        send_prebuilt_response(conn, shared_response);
+        return true;
+    }
+
+    // هدرها و بدنه فایل پشت هم در صف؛ موتور I/O هدرها را با MSG_MORE می‌فرستد تا با ابتدای فایل در
+    // بسته‌های کامل بروند
+    send_prebuilt_response(conn, move(response_headers));
+    conn.send_file(file, 0, file_size);
+    return true;
+}
+
+void serve_static_file(Connection& conn, const string& full_path, const Request& request) { 
+    // تابع برای ارسال فایل‌های استاتیک یا آپلودی (zero-copy با sendfile)
+    string mime_type = get_mime_type(full_path);
+    bool negotiable = is_cacheable_static_path(full_path) && is_compressible_mime(mime_type);
+    string vary_header = negotiable ? "Vary: Accept-Encoding\r\n" : "";
+
+    // Range روی نسخه فشرده معنای متفاوتی دارد؛ درخواست‌های Range همیشه نسخه اصلی را می‌گیرند
+    if (negotiable && !request.has_header(KnownHeader::RANGE)) {
+        const ContentCoding* codings[2];
+        size_t coding_count = negotiate_content_codings(request, codings);
+        for (size_t i = 0; i < coding_count; ++i) {
+            const ContentCoding* coding = codings[i];
+            string encoding_headers = string("Content-Encoding: ") + coding->name + "\r\n" + vary_header;
+            if (send_file_representation(conn, full_path + coding->extension, mime_type, encoding_headers, request, &full_path)) return;
+        }
+    }
+
+    if (!send_file_representation(conn, full_path, mime_type, vary_header, request, nullptr)) {
+        string content = "<h1>404 - پیدا نشد</h1><p>فایل یا مسیر در سرور پیدا نشد.</p>";
+        send_response(conn, build_http_response(content, 404));
+    }
+}
+
+string list_files(const string& upload_dir) {
+    // تابع ساخت صفحه HTML مدیریت فایل (File Manager)
+    string html_content =
+        "<!DOCTYPE html><html><head><title>مدیریت فایل</title><link rel=\"stylesheet\" href=\"/style.css\"></head><body class=\"list-files-section\">"
+        "<h1>مدیریت فایل‌ها (فایل منیجر)</h1>"
+        "<p>فایل‌های آپلود شده در پوشه‌ی <code>uploads/</code> ذخیره می‌شوند. این فرآیند از <a href=\"/\" style=\"color:#3498db;\">Streaming Upload</a> استفاده می‌کند.</p>"
+        
+        "<h2>✅ آپلود فایل جدید</h2>"
+        "<div class=\"upload-box\">"
+        "<input type=\"file\" id=\"fileInput\" required>"
+        "<button onclick=\"uploadFile()\">آپلود فایل</button>"
+        "<span id=\"uploadStatus\" style=\"margin-right: 15px; font-weight: bold;\"></span>"
+        "</div>"
+        
+        "<h2>📂 فایل‌های ذخیره شده</h2><ul>";
+
+    DIR *dir;
+    struct dirent *ent;
+
+    if ((dir = opendir(upload_dir.c_str())) != NULL) {
+        while ((ent = readdir(dir)) != NULL) {
+            string filename = ent->d_name;
+            if (filename != "." && filename != "..") {
+                // نمایش فایل و دکمه حذف
+                html_content += "<li>"
+                                "<a href=\"/files/" + filename + "\" target=\"_blank\">" + filename + "</a>"
+                                "<button onclick=\"deleteFile('" + filename + "')\">حذف دائمی</button>"
+                                "</li>";
+            }
+        }
+        closedir(dir);
+    } else {
+        html_content += "<li>خطا: قادر به باز کردن پوشه‌ی آپلود نیست. مطمئن شوید پوشه <code>uploads/</code> وجود دارد.</li>";
+    }
+
+    html_content += "</ul>";
+    
+    // جاوااسکریپت ساده برای آپلود و حذف
+    html_content +=
+        "<script>"
+        "function uploadFile() {"
+            "const fileInput = document.getElementById('fileInput');"
+            "const statusSpan = document.getElementById('uploadStatus');"
+            "const file = fileInput.files[0];"
+            "if (!file) { alert('لطفا یک فایل انتخاب کنید.'); return; }"
+            
+            "statusSpan.textContent = 'در حال آپلود...'; statusSpan.style.color = '#e67e22';"
+            "const xhr = new XMLHttpRequest();"
+            "xhr.open('POST', '/upload', true);"
+            "xhr.setRequestHeader('Content-Type', 'application/octet-stream');" 
+            
+            "xhr.onload = function() {"
+                "let response = {error: 'خطای نامشخص'};"
+                "try { response = JSON.parse(xhr.responseText); } catch(e) {}"
+                
+                "if (xhr.status === 200) {"
+                    "statusSpan.textContent = '✅ آپلود موفقیت‌آمیز';"
+                    "setTimeout(() => { window.location.reload(); }, 1500);" 
+                "} else {"
+                    "statusSpan.textContent = '❌ خطای آپلود';"
+                    "alert('خطا در آپلود: ' + (response.error || 'Server Error.'));"
+                "}"
+            "};"
+            
+            "xhr.onerror = function() {"
+                "statusSpan.textContent = '❌ خطای شبکه';"
+                "alert('خطای شبکه رخ داد.');"
+            "};"
+            
+            "xhr.send(file);" 
+        "}"
+        
+        "function deleteFile(filename) {"
+            "if (confirm('⚠️ آیا مطمئن هستید که می‌خواهید ' + filename + ' را حذف کنید؟ این عملیات برگشت ناپذیر است.')) {"
+                "const xhr = new XMLHttpRequest();"
+                "xhr.open('DELETE', '/files/' + filename, true);"
+                
+                "xhr.onload = function() {"
+                    "const response = JSON.parse(xhr.responseText);"
+                    "if (xhr.status === 200) {"
+                        "alert('✅ حذف موفقیت‌آمیز: ' + response.message);"
+                        "window.location.reload();"
+                    "} else {"
+                        "alert('❌ خطا در حذف فایل: ' + response.error);"
+                    "}"
+                "};"
+                "xhr.send();"
+            "}"
+        "}"
+        "</script>"
+        "<p><a href=\"/\">بازگشت به صفحه اصلی</a></p>"
+        "</body></html>";
+    
+    return html_content;
+}
+
+
+// بدنه آپلود جریانی: هر تکه همان‌طور که از سوکت می‌رسد در فایل نوشته می‌شود و هیچ نخی منتظر کلاینت
+// کند نمی‌ماند. اگر اتصال پیش از رسیدن کل بدنه بسته شود (قطع اتصال یا پایان مهلت بدنه) فایل ناقص حذف می‌شود.
+class UploadSink : public BodySink {
+private:
+    string filename;
+    ofstream outfile;
+    bool finished = false;
+
+public:
+    UploadSink(const string& path, uint64_t remaining_bytes)
+        : BodySink(remaining_bytes), filename(path), outfile(path, ios::binary) {}
+
+    ~UploadSink() override {
+        if (finished || !outfile.is_open()) return;
+        outfile.close();
+        remove(filename.c_str()); // حذف فایل ناقص
+        log_message(LogLevel::WARN, "قطع اتصال یا داده ناقص هنگام آپلود.");
+    }
+
+    bool is_open() const { return outfile.is_open(); }
+
+    void write(const char* data, size_t length) override { outfile.write(data, length); }
+
+    void finish(Connection& conn) override {
+        finished = true;
+        outfile.close();
+        if (!outfile) {
+            remove(filename.c_str());
+            log_message(LogLevel::ERROR, "خطا در نوشتن فایل آپلودی: " + filename);
+            send_response(conn, build_http_response("{\"error\": \"Cannot save file on server disk.\"}", 500, "application/json"));
+            return;
+        }
+        log_message("فایل ذخیره شد: " + filename);
+        send_response(conn, build_http_response("{\"message\": \"File uploaded successfully to " + filename + "\"}", 200, "application/json"));
+    }
+};
+
+void handle_upload_stream(Connection& conn, string_view initial_body, long content_length) {
     // تابع برای مدیریت دریافت جریانی (Streaming) فایل آپلودی
     stringstream ss;
-    time_t timer;
-    time(&timer);
     // ساخت نام فایل یونیک (با تاریخ و عدد تصادفی)
-    ss << UPLOAD_ROOT << "/file_" << std::put_time(std::localtime(&timer), "%Y%m%d%H%M%S") << "_" << rand() % 1000 << ".bin";
+    ss << UPLOAD_ROOT << "/file_" << server_clock.now().file_stamp << "_" << rand() % 1000 << ".bin";
     string filename = ss.str();
-    
-    ofstream outfile(filename, ios::binary);
-    if (!outfile.is_open()) {
-        log_message("خطا در باز کردن فایل برای ذخیره: " + filename);
-        string response_str = build_http_response("{\"error\": \"Cannot save file on server disk.\"}", 500, "application/json");
-        send(client_socket, response_str.c_str(), response_str.length(), 0);
+
+    auto sink = make_unique<UploadSink>(filename, content_length - initial_body.length());
+    if (!sink->is_open()) {
+        log_message(LogLevel::ERROR, "خطا در باز کردن فایل برای ذخیره: " + filename);
+        send_response(conn, build_http_response("{\"error\": \"Cannot save file on server disk.\"}", 500, "application/json"));
         return;
     }
 
-    outfile.write(initial_body.c_str(), initial_body.length());
-    long bytes_written = initial_body.length();
-    long remaining_to_read = content_length - bytes_written;
-    
-    vector<char> buffer(BUFFER_SIZE);
-    while (remaining_to_read > 0) {
-        size_t read_now = min((long)BUFFER_SIZE, remaining_to_read);
-        long bytes_read = read(client_socket, buffer.data(), read_now);
-        
-        if (bytes_read <= 0) {
-            outfile.close();
-            remove(filename.c_str()); // حذف فایل ناقص
-            log_message("قطع اتصال یا داده ناقص هنگام آپلود.");
-            string response_str = build_http_response("{\"error\": \"Connection lost or incomplete data during upload.\"}", 500, "application/json");
-            send(client_socket, response_str.c_str(), response_str.length(), 0);
+    // بقیه بدنه را process_buffered_requests با رسیدن هر بخش به sink می‌دهد
+    sink->write(initial_body.data(), initial_body.length());
+    conn.body_sink = move(sink);
+}
+
+
+// ----------------------------------------------------------------------
+// --- ۴. هندلرهای ماژولار (CRUD) ---
+// ----------------------------------------------------------------------
+
+// نوشتن سطرهای کرسر به صورت شیء JSON با ترتیب ستون‌های SELECT؛ کلیدها (با نقل قول و دونقطه) یک‌بار
+// ساخته می‌شوند. مقادیر مثل JsonParser::stringify رشته‌اند. فقط column_count ستون اول نوشته می‌شود
+// (ستون‌های بعدی مثلاً id کمکی برای seek هستند).
+class JsonRowWriter {
+private:
+    vector<string> keys;
+
+public:
+    JsonRowWriter(const DatabaseManager::Cursor& cursor, size_t column_count) {
+        for (size_t i = 0; i < column_count; ++i) {
+            string key;
+            JsonParser::append_string(key, cursor.column_name(i));
+            keys.push_back(key + ": ");
+        }
+    }
+
+    void append(string& out, const DatabaseManager::Cursor& row) const {
+        out += '{';
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (i > 0) out += ',';
+            out += keys[i];
+            JsonParser::append_string(out, row.text(i));
+        }
+        out += '}';
+    }
+};
+
+// ستون‌های مجاز برای fields= به ترتیب ثابت؛ ترتیب و تکرار در درخواست اهمیتی ندارد تا تعداد متن‌های
+// SQL متمایز (و statementهای کش‌شده) محدود بماند
+const string_view USER_FIELDS[] = {"id", "name", "email"};
+
+enum class UsersBatch { DONE, MORE, UNAVAILABLE, FAILED };
+
+// خواندن یک دسته از سطرهای GET /api/users در out تا پر شدن یک فریم (STREAM_CHUNK_SIZE). کرسر و اتصال
+// دیتابیس پیش از بازگشت آزاد می‌شوند؛ last_id و remaining برای seek دسته بعد به‌روز می‌شوند. MORE یعنی
+// دسته به خاطر پر شدن فریم تمام شده و ممکن است سطر دیگری باقی باشد.
+static UsersBatch read_users_batch(const string& sql, const string* email, size_t field_count, size_t id_column,
+                                   string& out, bool& first_row, int64_t& last_id, int64_t& remaining) {
+    vector<SqlParam> params;
+    if (email) params.push_back(*email);
+    params.push_back(last_id);
+    params.push_back(remaining);
+    DatabaseManager::Cursor users = db_manager->query(sql, params);
+    if (users.unavailable()) return UsersBatch::UNAVAILABLE;
+    JsonRowWriter rows(users, field_count);
+    while (out.length() < STREAM_CHUNK_SIZE) {
+        if (!users.next()) return users.ok() ? UsersBatch::DONE : UsersBatch::FAILED;
+        if (!first_row) out += ",\n";
+        first_row = false;
+        rows.append(out, users);
+        last_id = users.integer(id_column);
+        if (remaining > 0 && --remaining == 0) return UsersBatch::DONE;
+    }
+    return UsersBatch::MORE;
+}
+
+// پاسخ جریانی GET /api/users: هر produce فریم پرشده قبلی را به صف خروجی می‌دهد و دسته بعد را می‌خواند
+class UsersStream : public ResponseProducer {
+private:
+    ChunkedResponseWriter writer;
+    string sql;
+    string email;
+    bool has_email;
+    size_t field_count;
+    size_t id_column;
+    UsersBatch batch = UsersBatch::MORE; // نتیجه آخرین دسته خوانده‌شده در بافر writer
+    bool first_row = true;
+    int64_t last_id;
+    int64_t remaining;
+
+    UsersBatch read_batch() {
+        return read_users_batch(sql, has_email ? &email : nullptr, field_count, id_column, writer.buffer(),
+                                first_row, last_id, remaining);
+    }
+
+public:
+    UsersStream(Connection& conn, const Request& request, string query, string email_value, bool email_filter,
+                size_t fields, size_t id_index, int64_t after_id, int64_t limit)
+        : writer(conn, request, 200, "application/json"), sql(move(query)), email(move(email_value)),
+          has_email(email_filter), field_count(fields), id_column(id_index), last_id(after_id), remaining(limit) {}
+
+    // دسته اول پیش از ارسال هدرها خوانده می‌شود تا خطا هنوز با کد وضعیت مناسب گزارش شود
+    UsersBatch start() {
+        writer.buffer() += "[\n";
+        batch = read_batch();
+        return batch;
+    }
+
+    Result produce(Connection& conn) override {
+        if (batch == UsersBatch::DONE) {
+            writer.buffer() += "\n]";
+            writer.finish();
+            return Result::DONE;
+        }
+        // خطای میانه راه: فریم پایانی ارسال نمی‌شود تا کلاینت پاسخ ناقص را تشخیص دهد
+        if (batch != UsersBatch::MORE) return Result::FAILED;
+        writer.flush_if_full();
+        batch = read_batch();
+        return Result::MORE;
+    }
+};
+
+// عدد صحیح کامل از query string؛ false برای مقدار ناقص یا خارج از بازه
+static bool parse_query_integer(const string& text, int64_t min_value, int64_t max_value, int64_t& value) {
+    auto [end, error] = from_chars(text.data(), text.data() + text.length(), value);
+    return error == errc() && end == text.data() + text.length() && value >= min_value && value <= max_value;
+}
+
+// R - Read Users
+// GET /api/users?limit=N&after_id=ID&fields=id,name&email=E
+//   limit: حداکثر تعداد سطرها (1 تا USERS_MAX_LIMIT؛ در نبود آن همه سطرها)
+//   after_id: صفحه‌بندی keyset؛ فقط id های بزرگ‌تر، به ترتیب id (صفحه بعد با آخرین id صفحه قبل)
+//   fields: زیرمجموعه‌ای از id,name,email
+//   email: جستجوی دقیق روی ایندکس UNIQUE ستون email
+// شرط‌ها همیشه bind می‌شوند (after_id پیش‌فرض -1 و LIMIT -1 یعنی بدون سقف) تا متن SQL فقط به fields
+// و وجود email بستگی داشته باشد و همه حالت‌ها در کش statement جا شوند. هر صفحه با جستجو روی
+// کلید اصلی شروع می‌شود، پس هزینه آن O(اندازه صفحه) است نه O(جدول).
+// سطرها در دسته‌هایی به اندازه یک فریم chunked خوانده می‌شوند (UsersStream) و اتصال دیتابیس پیش از هر
+// ارسال آزاد می‌شود: ارسال به کلاینت کند تا write_timeout طول می‌کشد و نباید اتصال‌های استخر (یا قفل
+// نویسنده) و تراکنش خواندن WAL را که جلوی checkpoint را می‌گیرد نگه دارد. دسته بعد فقط پس از ارسال فریم
+// قبلی و با آخرین id دوباره seek می‌کند، پس حافظه مستقل از تعداد کاربران است و در این فاصله هیچ نخی
+// منتظر کلاینت نمی‌ماند.
+HttpResponse api_users_get_handler(const Request& request, Connection& conn) {
+    int64_t limit = -1;
+    int64_t after_id = -1;
+    string value;
+    if (request.query_param("limit", value) && !parse_query_integer(value, 1, USERS_MAX_LIMIT, limit)) {
+        return build_http_response("{\"error\": \"'limit' must be an integer between 1 and " + to_string(USERS_MAX_LIMIT) + ".\"}", 400, "application/json");
+    }
+    if (request.query_param("after_id", value) && !parse_query_integer(value, 0, INT64_MAX, after_id)) {
+        return build_http_response("{\"error\": \"'after_id' must be a non-negative integer.\"}", 400, "application/json");
+    }
+
+    bool selected[size(USER_FIELDS)] = {};
+    if (request.query_param("fields", value)) {
+        bool valid = true;
+        for_each_list_item(value, [&](string_view field) {
+            auto it = find(begin(USER_FIELDS), end(USER_FIELDS), field);
+            if (it == end(USER_FIELDS)) {
+                valid = false;
+                return false;
+            }
+            selected[it - begin(USER_FIELDS)] = true;
+            return true;
+        });
+        if (!valid || find(begin(selected), end(selected), true) == end(selected)) {
+            return build_http_response("{\"error\": \"'fields' must be a comma-separated subset of id,name,email.\"}", 400, "application/json");
+        }
+    } else {
+        fill(begin(selected), end(selected), true);
+    }
+
+    // id همیشه خوانده می‌شود (در صورت نبود در fields به صورت ستون آخر و بدون نمایش) تا دسته بعد seek کند
+    string sql = "SELECT ";
+    size_t field_count = 0;
+    for (size_t i = 0; i < size(USER_FIELDS); ++i) {
+        if (!selected[i]) continue;
+        if (field_count++ > 0) sql += ", ";
+        sql += USER_FIELDS[i];
+    }
+    size_t id_column = selected[0] ? 0 : field_count;
+    if (!selected[0]) sql += ", id";
+    sql += " FROM users WHERE ";
+    string email;
+    bool has_email = request.query_param("email", email);
+    if (has_email) sql += "email = ? AND ";
+    sql += "id > ? ORDER BY id LIMIT ?;";
+
+    auto stream = make_unique<UsersStream>(conn, request, move(sql), move(email), has_email, field_count, id_column,
+                                           after_id, limit);
+    UsersBatch batch = stream->start();
+    if (batch == UsersBatch::UNAVAILABLE) {
+        HttpResponse response = build_http_response("{\"error\": \"Database is busy, try again later.\"}", 503, "application/json");
+        response.extra_headers = "Retry-After: " + to_string(server_config.retry_after_seconds) + "\r\n";
+        return response;
+    }
+    if (batch == UsersBatch::FAILED) {
+        return build_http_response("{\"error\": \"Failed to retrieve users from database.\"}", 500, "application/json");
+    }
+
+    conn.producer = move(stream);
+    return HttpResponse::sent();
+}
+
+// C - Create New User
+HttpResponse api_users_post_handler(const Request& request, Connection& conn) {
+    try {
+        map<string, string> new_user_data = JsonParser::parse(string(request.body));
+        
+        if (new_user_data.count("name") && new_user_data.count("email") && new_user_data.at("email").find('@') != string::npos) {
+            
+            string name = new_user_data.at("name");
+            string email = new_user_data.at("email");
+            
+            // کوئری INSERT با Prepared Statements (بسیار امن‌تر)
+            string sql = "INSERT INTO users (name, email) VALUES (?, ?);";
+            vector<SqlParam> params = {name, email};
+            
+            long new_id = 0;
+            if (db_manager->prepare_and_execute(sql, params, &new_id)) {
+
+                new_user_data["id"] = to_string(new_id);
+                string response_json = JsonParser::stringify(new_user_data);
+
+                log_message("کاربر جدید در دیتابیس ایجاد شد: ID " + new_user_data.at("id"));
+                return build_http_response(response_json, 201, "application/json");
+
+            } else {
+                return build_http_response("{\"error\": \"Database insertion failed (Email might be duplicate, UNIQUE constraint violation).\"}", 500, "application/json");
+            }
+        } else {
+            return build_http_response("{\"error\": \"Name and a valid email are required.\"}", 400, "application/json");
+        }
+    } catch (const exception& e) {
+        return build_http_response("{\"error\": \"Invalid JSON format or input: " + string(e.what()) + "\"}", 400, "application/json");
+    }
+}
+
+// U - Update Existing User
+HttpResponse api_users_put_handler(const Request& request, Connection& conn) {
+    try {
+        // ۱. ID از پارامتر مسیر: PUT /api/users/:id
+        string id_str(request.param("id"));
+        int64_t id = 0;
+        auto [id_end, id_error] = from_chars(id_str.data(), id_str.data() + id_str.length(), id);
+        if (id_error != errc() || id_end != id_str.data() + id_str.length()) {
+            return build_http_response("{\"error\": \"User id must be an integer.\"}", 400, "application/json");
+        }
+        
+        // ۲. تجزیه بدنه JSON
+        map<string, string> update_data = JsonParser::parse(string(request.body));
+        
+        if (!(update_data.count("name") || update_data.count("email"))) {
+            return build_http_response("{\"error\": \"Require 'name' or 'email' field to update.\"}", 400, "application/json");
+        }
+        
+        // ۳. ساخت کوئری UPDATE پویا با Prepared Statements
+        string sql = "UPDATE users SET ";
+        vector<SqlParam> params; // به رشته‌های update_data اشاره می‌کنند
+        
+        if (update_data.count("name")) {
+            sql += "name = ?, ";
+            params.push_back(update_data.at("name"));
+        }
+        if (update_data.count("email")) {
+            sql += "email = ?, ";
+            params.push_back(update_data.at("email"));
+        }
+        
+        // حذف کامای اضافی و اضافه کردن شرط WHERE
+        sql = sql.substr(0, sql.length() - 2); 
+        sql += " WHERE id = ?;";
+        params.push_back(id);
+
+        if (db_manager->prepare_and_execute(sql, params)) {
+            log_message("کاربر با ID " + id_str + " به‌روزرسانی شد.");
+            return build_http_response("{\"message\": \"User " + id_str + " updated successfully.\"}", 200, "application/json");
+        } else {
+            return build_http_response("{\"error\": \"Database update failed (ID not found or Email is duplicate).\"}", 500, "application/json");
+        }
+
+    } catch (const exception& e) {
+        return build_http_response("{\"error\": \"Invalid JSON format or URL structure: " + string(e.what()) + "\"}", 400, "application/json");
+    }
+}
+
+// Handler برای شمارنده (تست Atomic)؛ شمارنده تقسیم‌شده است، پس عدد نمایش داده‌شده تحت بار هم‌زمان
+// ممکن است برای دو درخواست یکسان باشد، اما هیچ بازدیدی گم نمی‌شود
+HttpResponse count_get_handler(const Request& request, Connection& conn) {
+    counter.add();
+    uint64_t current_count = counter.value();
+    return build_http_response("<h1>شمارنده</h1><p>صفحه " + to_string(current_count) + " بار بازدید شده است.</p>", 200);
+}
+
+// Handler برای متریک‌های Prometheus
+HttpResponse metrics_get_handler(const Request& request, Connection& conn) {
+    return build_http_response(metrics.render_prometheus(), 200, "text/plain; version=0.0.4");
+}
+
+// Handler برای صفحه File Manager
+HttpResponse files_get_handler(const Request& request, Connection& conn) {
+    return build_http_response(list_files(UPLOAD_ROOT), 200);
+}
+
+// Handler برای دریافت فایل آپلودی (Streaming)
+HttpResponse upload_post_handler(const Request& request, Connection& conn) {
+    if (request.has_header(KnownHeader::CONTENT_LENGTH)) {
+        try {
+            long content_length = request.content_length; // مقدار توسط HttpParser اعتبارسنجی شده است
+            if (content_length > 1024 * 1024 * 500) { // محدودیت ۵۰۰ مگابایت
+                 return build_http_response("{\"error\": \"File size exceeds 500MB limit.\"}", 413, "application/json");
+            }
+            handle_upload_stream(conn, request.body, content_length); 
+            return HttpResponse::sent();
+        } catch (const exception& e) {
+            return build_http_response("{\"error\": \"Error processing Content-Length or during streaming: " + string(e.what()) + "\"}", 500, "application/json");
+        }
+    } else {
+        return build_http_response("{\"error\": \"Content-Length header is required for upload.\"}", 400, "application/json");
+    }
+}
+
+// صفحه اصلی HTML کامل از فایل index.html
+HttpResponse index_get_handler(const Request& request, Connection& conn) {
+    serve_static_file(conn, WEB_ROOT + "/index.html", request);
+    return HttpResponse::sent();
+}
+
+// دانلود فایل‌های آپلودی: GET /files/*name
+HttpResponse uploaded_file_get_handler(const Request& request, Connection& conn) {
+    serve_static_file(conn, UPLOAD_ROOT + sanitize_path(string(request.param("name"))), request);
+    return HttpResponse::sent();
+}
+
+// سرویس‌دهی فایل‌های استاتیک (مثل css و js): GET /*path
+HttpResponse static_file_get_handler(const Request& request, Connection& conn) {
+    string path = sanitize_path(string(request.param("path")));
+    // فایل‌ها و پوشه‌های نقطه‌دار (مثل فایل‌های موقت Precompressor) سرو نمی‌شوند
+    if (path.find("/.") != string::npos) {
+        return build_http_response("<h1>404 - پیدا نشد</h1><p>فایل یا مسیر در سرور پیدا نشد.</p>", 404);
+    }
+    serve_static_file(conn, WEB_ROOT + path, request);
+    return HttpResponse::sent();
+}
+
+// D - Delete File
+HttpResponse files_delete_handler(const Request& request, Connection& conn) {
+    string filename_to_delete(request.param("name"));
+    if (filename_to_delete.empty()) {
+        return build_http_response("{\"error\": \"Filename is missing.\"}", 400, "application/json");
+    }
+
+    string full_path = UPLOAD_ROOT + "/" + filename_to_delete;
+
+    // کنترل امنیتی: جلوگیری از Directory Traversal
+    if (filename_to_delete.find("..") != string::npos || filename_to_delete.find('/') != string::npos) {
+        return build_http_response("{\"error\": \"Security check failed (Invalid characters or Directory Traversal detected).\"}", 403, "application/json");
+    }
+
+    if (remove(full_path.c_str()) != 0) {
+        if (errno == ENOENT) {
+            return build_http_response("{\"error\": \"File not found.\"}", 404, "application/json");
+        } else {
+            log_message(LogLevel::ERROR, "خطا در حذف فایل: " + full_path + " - Error: " + strerror(errno));
+            return build_http_response("{\"error\": \"Could not delete file due to server error.\"}", 500, "application/json");
+        }
+    }
+
+    log_message("فایل حذف شد: " + full_path);
+    return build_http_response("{\"message\": \"File deleted successfully.\"}", 200, "application/json");
+}
+
+
+// مسیرهای بدون پارامتر؛ جدول و dispatch آن‌ها در زمان کامپایل ساخته می‌شود
+constexpr StaticRoute STATIC_ROUTE_LIST[] = {
+    // CRUD API: Users
+    {HttpMethod::GET, "/api/users", api_users_get_handler},
+    {HttpMethod::POST, "/api/users", api_users_post_handler},
+    // File Manager
+    {HttpMethod::GET, "/files", files_get_handler},
+    {HttpMethod::POST, "/upload", upload_post_handler},
+    // Utility
+    {HttpMethod::GET, "/count", count_get_handler},
+    {HttpMethod::GET, "/metrics", metrics_get_handler},
+    {HttpMethod::GET, "/", index_get_handler},
+};
+
+constexpr StaticRouteTable static_route_table(STATIC_ROUTE_LIST);
+
+
+// ----------------------------------------------------------------------
+// --- ۵. هندلر اصلی کلاینت (ارتباط سوکت) ---
+// ----------------------------------------------------------------------
+
+// پایان تولید پاسخ درخواست جاری (پاسخ در صف خروجی است): متریک و لاگ دسترسی، و بستن اتصال پس از
+// ارسال اگر ماندگار نیست
+static void complete_request(Connection& conn) {
+    uint64_t latency_us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - conn.request_started).count();
+    metrics.observe_request(conn.request_route_id, conn.response_status, latency_us, conn.request_bytes, conn.response_bytes);
+    if (access_log.enabled()) {
+        access_log.record(conn.request_timestamp_us, conn.request_method, conn.request_route_id, conn.response_status,
+                          conn.response_bytes, conn.request_bytes, latency_us);
+    }
+    if (!conn.keep_alive) conn.close_after_output = true;
+}
+
+// نتیجه پیش‌برد درخواست‌های یک اتصال
+enum class RequestProgress {
+    NEED_INPUT, // منتظر بایت‌های بیشتر از کلاینت؛ phase مرحله انتظار را نشان می‌دهد
+    NEED_FLUSH, // خروجی در صف است؛ ادامه (درخواست بعدی یا فریم بعدی پاسخ جریانی) پس از ارسال آن
+    CLOSE,      // اتصال باید فوراً بسته شود
+};
+
+// پیش‌برد درخواست‌های اتصال با داده‌های موجود در بافر (پشتیبانی از pipelining): ادامه پاسخ جریانی،
+// تحویل بدنه جریانی به sink و پاسخ به درخواست‌های کامل. پس از هر پاسخ برمی‌گردد تا موتور I/O صف خروجی
+// را ارسال کند؛ هیچ‌جا منتظر سوکت نمی‌ماند.
+RequestProgress process_buffered_requests(Connection& conn, Router& router) {
+    while (true) {
+        if (conn.producer) {
+            ResponseProducer::Result result = conn.producer->produce(conn);
+            if (result == ResponseProducer::Result::FAILED) return RequestProgress::CLOSE;
+            if (result == ResponseProducer::Result::DONE) {
+                conn.producer.reset();
+                complete_request(conn);
+            }
+            return RequestProgress::NEED_FLUSH;
+        }
+        if (conn.body_sink) {
+            BodySink& sink = *conn.body_sink;
+            size_t length = (size_t)min<uint64_t>(conn.in_buffer.size(), sink.remaining);
+            sink.write(conn.in_buffer.data(), length);
+            sink.remaining -= length;
+            conn.in_buffer.consume(length);
+            if (sink.remaining > 0) {
+                conn.phase = ConnectionPhase::BODY;
+                return RequestProgress::NEED_INPUT;
+            }
+            sink.finish(conn);
+            conn.body_sink.reset();
+            complete_request(conn);
+            return RequestProgress::NEED_FLUSH;
+        }
+        if (conn.close_after_output) return RequestProgress::NEED_FLUSH; // پس از پاسخ پایانی درخواستی خوانده نمی‌شود
+
+        Request& request = conn.request;
+        HttpParser::Status status = conn.parser.parse(conn.in_buffer.view(), request);
+        if (status == HttpParser::Status::INCOMPLETE) {
+            // منتظر رسیدن بقیه هدرها (یا درخواست بعدی keep-alive) می‌مانیم
+            conn.phase = conn.in_buffer.empty() ? ConnectionPhase::IDLE : ConnectionPhase::HEADER;
+            return RequestProgress::NEED_INPUT;
+        }
+        if (status != HttpParser::Status::COMPLETE) {
+            conn.response_bytes = 0;
+            conn.keep_alive = false;
+            conn.close_after_output = true;
+            int error_status = 400;
+            if (status == HttpParser::Status::UNSUPPORTED_ENCODING) {
+                error_status = 501;
+                send_response(conn, build_http_response("<h1>501</h1><p>Transfer-Encoding در بدنه درخواست پشتیبانی نمی‌شود.</p>", 501));
+            } else {
+                send_response(conn, build_http_response(status == HttpParser::Status::TOO_LARGE
+                                                            ? "<h1>400</h1><p>هدرهای درخواست بیش از حد بزرگ است.</p>"
+                                                            : "<h1>400</h1><p>درخواست نامعتبر است.</p>", 400));
+            }
+            metrics.observe_request(0, error_status, 0, conn.in_buffer.size(), conn.response_bytes);
+            if (access_log.enabled()) {
+                access_log.record(AccessLog::timestamp_now(), (uint8_t)HttpMethod::OTHER, 0, error_status,
+                                  conn.response_bytes, conn.in_buffer.size(), 0);
+            }
+            return RequestProgress::NEED_FLUSH;
+        }
+
+        // بدنه‌های کوچک کامل در بافر جمع می‌شوند؛ بدنه‌های بزرگ (مثل آپلود) را هندلر با یک BodySink جریانی می‌گیرد
+        size_t available = conn.in_buffer.size() - request.head_length;
+        bool streamed_body = false;
+        if ((size_t)request.content_length > available) {
+            if ((size_t)request.content_length <= MAX_BUFFERED_BODY) {
+                conn.phase = ConnectionPhase::BODY; // منتظر بقیه بدنه
+                return RequestProgress::NEED_INPUT;
+            }
+            streamed_body = true;
+        }
+        size_t body_length = min(available, (size_t)request.content_length);
+        request.body = string_view(conn.in_buffer.data() + request.head_length, body_length);
+
+        if (logger.enabled(LogLevel::DEBUG)) {
+            log_message(LogLevel::DEBUG, "درخواست: " + string(request.method) + " " + string(request.path));
+        }
+
+        // هندلری که بدنه جریانی را نپذیرد (خطا پیش از خواندن آن) بقیه بدنه را در سوکت رها می‌کند.
+        // تصمیم پیش از هندلر گرفته می‌شود تا هدر Connection پاسخ با بستن واقعی اتصال بخواند.
+        conn.keep_alive = request.keep_alive && !streamed_body;
+
+        // مسیریابی و اجرای هندلر؛ بافر تا پایان هندلر دست نمی‌خورد تا string_viewهای درخواست معتبر بمانند
+        conn.response_bytes = 0;
+        conn.response_status = 0;
+        conn.request_timestamp_us = access_log.enabled() ? AccessLog::timestamp_now() : 0;
+        conn.request_started = chrono::steady_clock::now();
+        HttpResponse response = router.route_request(request, conn); 
+        conn.request_method = (uint8_t)parse_http_method(request.method);
+        conn.request_route_id = request.route_id;
+        conn.request_bytes = request.head_length + request.content_length;
+        conn.in_buffer.consume(request.head_length + body_length);
+        conn.parser.reset();
+        conn.header_deadline_ms = 0; // مهلت هدر درخواست بعدی از اولین بایت آن شمرده می‌شود
+
+        // پاسخ (اگر هندلر خودش آن را به صف اضافه نکرده باشد، مثل سرویس فایل یا پاسخ جریانی)
+        if (response.close_connection) conn.keep_alive = false;
+        if (!response.already_sent) send_response(conn, move(response));
+        // پاسخ جریانی یا بدنه جریانی در دورهای بعدی همین حلقه کامل می‌شوند
+        if (conn.producer || conn.body_sink) continue;
+        complete_request(conn);
+        return RequestProgress::NEED_FLUSH;
+    }
+}
+
+// اتصال مدیریت شده توسط epoll: نخ پردازشگر مستقیم روی سوکت non-blocking می‌خواند و می‌نویسد و با
+// رسیدن به EAGAIN اتصال را به حلقه برمی‌گرداند
+class EpollConnection : public Connection {
+public:
+    enum class FlushResult { DONE, BLOCKED, FAILED };
+
+    EpollConnection(int socket_fd, uint32_t ip) : Connection(socket_fd, ip) {}
+
+    // ارسال صف خروجی تا خالی شدن یا EAGAIN: تکه‌های حافظه با sendmsg (scatter-gather) و بازه‌های فایل با
+    // sendfile. پیش از بازه فایل MSG_MORE داده می‌شود تا هدرها با ابتدای فایل در بسته‌های کامل بروند.
+    FlushResult flush_output() {
+        while (!output.empty()) {
+            ssize_t sent;
+            OutputSegment& front = output.front();
+            if (front.is_file()) {
+                off_t offset = front.offset;
+                sent = sendfile(fd, front.file_fd, &offset, front.length);
+                if (sent == 0) return FlushResult::FAILED; // فایل در حین ارسال کوتاه شده است
+            } else {
+                struct iovec iov[SEND_IOV_BATCH];
+                bool more;
+                struct msghdr message = {};
+                message.msg_iov = iov;
+                message.msg_iovlen = output.gather(iov, SEND_IOV_BATCH, more);
+                sent = sendmsg(fd, &message, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+            }
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return FlushResult::BLOCKED;
+                return FlushResult::FAILED;
+            }
+            output.consume(sent);
+        }
+        return FlushResult::DONE;
+    }
+};
+
+// رویدادی که اتصال پس از کار نخ پردازشگر منتظر آن است
+enum class ClientWait { READABLE, WRITABLE, CLOSE };
+
+// فراخوانی توسط نخ‌های استخر پس از اعلام آمادگی سوکت توسط epoll (Edge-Triggered).
+// خروجی منتظر را ارسال، ورودی را تا EAGAIN می‌خواند و درخواست‌ها را پیش می‌برد؛ وقتی سوکت آماده نیست
+// برمی‌گردد تا حلقه برای خواندن یا نوشتن دوباره مسلح کند. نخ هرگز منتظر کلاینت نمی‌ماند.
+ClientWait handle_client(EpollConnection& conn, Router& router) {
+    const size_t max_buffered = MAX_HEADER_SIZE + MAX_BUFFERED_BODY;
+    bool peer_open = true;
+    bool drained = false; // آخرین خواندن به EAGAIN رسید
+
+    while (true) {
+        switch (conn.flush_output()) {
+            case EpollConnection::FlushResult::FAILED: return ClientWait::CLOSE;
+            case EpollConnection::FlushResult::BLOCKED:
+                conn.phase = ConnectionPhase::WRITE; // مرحله بعدی را process_buffered_requests پس از تخلیه تعیین می‌کند
+                return ClientWait::WRITABLE;
+            case EpollConnection::FlushResult::DONE: break;
+        }
+        if (conn.close_after_output) return ClientWait::CLOSE;
+
+        RequestProgress progress = process_buffered_requests(conn, router);
+        if (progress == RequestProgress::CLOSE) return ClientWait::CLOSE;
+        if (progress == RequestProgress::NEED_FLUSH) continue;
+
+        // کلاینت اتصال را بسته است و درخواست‌های باقیمانده در بافر پاسخ داده شده‌اند
+        if (!peer_open) return ClientWait::CLOSE;
+        if (drained) return ClientWait::READABLE;
+        if (conn.in_buffer.size() >= max_buffered) return ClientWait::CLOSE;
+
+        // خواندن مستقیم در انتهای بافر اتصال؛ بدون بافر میانی و کپی اضافه
+        while (conn.in_buffer.size() < max_buffered) {
+            char* destination = conn.in_buffer.prepare(BUFFER_SIZE);
+            long valread = read(conn.fd, destination, min(conn.in_buffer.writable_size(), max_buffered - conn.in_buffer.size()));
+            if (valread > 0) {
+                conn.in_buffer.commit(valread);
+            } else if (valread == 0) {
+                peer_open = false;
+                break;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                drained = true;
+                break;
+            } else {
+                return ClientWait::CLOSE;
+            }
+        }
+    }
+}
+
+
+// مهلت اتصال منتظر بر اساس مرحله‌اش؛ مهلت هدر مطلق است تا کلاینتی که هدرها را قطره‌قطره می‌فرستد
+// (slowloris) با هر بایت آن را تمدید نکند، ولی مهلت بدنه و keep-alive با هر دریافت و مهلت نوشتن با هر
+// ارسال موفق از نو شروع می‌شود (حلقه پس از هر پیشرفت دوباره زمان‌بندی می‌کند)
+uint64_t connection_timeout_ms(Connection& conn, uint64_t now_ms) {
+    switch (conn.phase) {
+        case ConnectionPhase::HEADER:
+            if (conn.header_deadline_ms == 0) conn.header_deadline_ms = now_ms + server_config.header_timeout_ms;
+            return conn.header_deadline_ms > now_ms ? conn.header_deadline_ms - now_ms : 0;
+        case ConnectionPhase::BODY:
+            return server_config.body_timeout_ms;
+        case ConnectionPhase::WRITE:
+            return server_config.write_timeout_ms;
+        default:
+            return server_config.keepalive_timeout_ms;
+    }
+}
+
+
+// ----------------------------------------------------------------------
+// --- ۶. استخر نخ‌ها و حلقه رویداد epoll (Reactor) ---
+// ----------------------------------------------------------------------
+
+// استخر نخ با اندازه ثابت؛ تعداد نخ‌ها دیگر با تعداد اتصال‌ها رشد نمی‌کند
+class ThreadPool {
+private:
+    vector<thread> workers;
+    queue<function<void()>> tasks;
+    mutex queue_mutex;
+    condition_variable queue_cv;
+    bool stopping;
+    atomic<size_t> queued{0};
+
+public:
+    explicit ThreadPool(size_t thread_count) : stopping(false) {
+        for (size_t i = 0; i < thread_count; ++i) {
+            workers.emplace_back([this] {
+                while (true) {
+                    function<void()> task;
+                    {
+                        unique_lock<mutex> lock(queue_mutex);
+                        queue_cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+                        if (stopping && tasks.empty()) return;
+                        task = move(tasks.front());
+                        tasks.pop();
+                        queued.fetch_sub(1, memory_order_relaxed);
+                    }
+                    task();
+                }
+            });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        queue_cv.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // تعداد کارهای منتظر (بدون قفل؛ برای تصمیم رد کردن اتصال در اضافه‌بار)
+    size_t queue_depth() const { return queued.load(memory_order_relaxed); }
+
+    void submit(function<void()> task) {
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            tasks.push(move(task));
+            queued.fetch_add(1, memory_order_relaxed);
+        }
+        queue_cv.notify_one();
+    }
+
+    size_t size() const { return workers.size(); }
+};
+
+// رابط مشترک حلقه‌های رویداد (epoll یا io_uring)؛ هر حلقه یک سوکت شنونده را سرویس می‌دهد
+class EventLoop {
+public:
+    virtual ~EventLoop() {}
+    virtual bool init() = 0;
+    virtual void run() = 0;
+};
+
+// حلقه رویداد: سوکت شنونده و سوکت‌های کلاینت را با epoll لبه‌ای (EPOLLET) و EPOLLONESHOT پایش می‌کند.
+// هر اتصال آماده به استخر نخ سپرده می‌شود و پس از پردازش برای خواندن یا (وقتی صف خروجی به EAGAIN
+// خورده) برای نوشتن دوباره مسلح (re-arm) می‌شود؛ EPOLLONESHOT تضمین می‌کند در هر لحظه فقط یک نخ روی
+// یک اتصال کار کند. اتصال منتظر (مسلح و بدون نخ) فقط یک گره در چرخ زمان‌سنج حلقه است و با انقضای
+// مهلتش بسته می‌شود.
+class EpollEventLoop : public EventLoop {
+private:
+    int epoll_fd;
+    int listen_fd;
+    Router& router;
+    ThreadPool& pool;
+
+    // نخ‌های پردازشگر زمان‌سنج را همراه با re-arm اضافه می‌کنند؛ چون هر دو زیر این قفل انجام می‌شوند،
+    // هر اتصالی که در چرخ است قطعاً در اختیار هیچ نخی نیست و حلقه می‌تواند آن را ببندد
+    mutex timers_mutex;
+    TimerWheel timers;
+    // اتصال‌هایی که به استخر سپرده شده‌اند و ممکن است هنگام re-arm زمان‌سنج اضافه کنند؛ تا وقتی صفر نیست
+    // epoll_wait نباید بی‌مهلت بخوابد، چون حلقه از زمان‌سنج تازه باخبر نمی‌شود
+    atomic<size_t> in_flight{0};
+
+    static const uint32_t CLIENT_EVENTS = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+    // تا خالی شدن صف خروجی ورودی تازه خوانده نمی‌شود (کنترل جریان)؛ EPOLLRDHUP هم نه، چون نیمه‌بسته شدن
+    // اتصال با هر re-arm دوباره گزارش می‌شد. خطا و قطع کامل (EPOLLERR/EPOLLHUP) همیشه گزارش می‌شوند.
+    static const uint32_t WRITE_EVENTS = EPOLLOUT | EPOLLET | EPOLLONESHOT;
+
+    void accept_connections() {
+        while (true) {
+            struct sockaddr_in peer;
+            socklen_t peer_length = sizeof(peer);
+            int client_socket = accept4(listen_fd, (struct sockaddr*)&peer, &peer_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_socket < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+                return;
+            }
+
+            AdmissionVerdict verdict = admission.try_admit(peer.sin_addr.s_addr, pool.queue_depth());
+            if (verdict != AdmissionVerdict::ADMIT) {
+                admission.reject(client_socket, verdict);
+                continue;
+            }
+            EpollConnection* conn = new EpollConnection(client_socket, peer.sin_addr.s_addr);
+            struct epoll_event ev;
+            ev.events = CLIENT_EVENTS;
+            ev.data.ptr = conn;
+            lock_guard<mutex> lock(timers_mutex);
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+                perror("epoll_ctl ADD");
+                close(client_socket);
+                delete conn;
+                continue;
+            }
+            uint64_t now = monotonic_ms();
+            timers.schedule(&conn->idle_timer, now, connection_timeout_ms(*conn, now));
+        }
+    }
+
+    void dispatch(EpollConnection* conn) {
+        {
+            lock_guard<mutex> lock(timers_mutex);
+            timers.cancel(&conn->idle_timer);
+        }
+        in_flight.fetch_add(1, memory_order_relaxed);
+        pool.submit([this, conn] {
+            ClientWait wait = handle_client(*conn, router);
+            if (wait == ClientWait::CLOSE) {
+                close(conn->fd); // بستن سوکت آن را از مجموعه epoll نیز حذف می‌کند
+                delete conn;
+            } else {
+                rearm(conn, wait == ClientWait::WRITABLE ? WRITE_EVENTS : CLIENT_EVENTS);
+            }
+            in_flight.fetch_sub(1, memory_order_release);
+        });
+    }
+
+    void rearm(EpollConnection* conn, uint32_t events) {
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = conn;
+        uint64_t now = monotonic_ms();
+        unique_lock<mutex> lock(timers_mutex);
+        timers.schedule(&conn->idle_timer, now, connection_timeout_ms(*conn, now));
+        // EPOLL_CTL_MOD آمادگی فعلی را دوباره بررسی می‌کند، پس داده‌ای که بین EAGAIN و این فراخوانی رسیده گم نمی‌شود
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+            perror("epoll_ctl MOD");
+            timers.cancel(&conn->idle_timer);
+            lock.unlock();
+            close(conn->fd);
+            delete conn;
+        }
+    }
+
+    // بستن اتصال‌هایی که مهلتشان تمام شده است؛ پس از پردازش رویدادهای همین دور اجرا می‌شود تا
+    // رویداد کهنه‌ای برای اتصال آزادشده باقی نماند
+    void expire_timers() {
+        vector<Connection*> expired;
+        {
+            lock_guard<mutex> lock(timers_mutex);
+            timers.advance(monotonic_ms(), [&expired](TimerNode* node) { expired.push_back(node->owner); });
+        }
+        for (Connection* conn : expired) {
+            metrics.connection_timed_out((size_t)conn->phase);
+            close(conn->fd);
+            delete conn;
+        }
+    }
+
+    int next_timeout_ms() {
+        // in_flight پیش از چرخ خوانده می‌شود: اگر صفر باشد، زمان‌سنج همه re-armها در چرخ دیده می‌شود
+        bool workers_busy = in_flight.load(memory_order_acquire) > 0;
+        lock_guard<mutex> lock(timers_mutex);
+        if (workers_busy && timers.empty()) return (int)TIMER_TICK_MS;
+        return timers.poll_timeout_ms(monotonic_ms());
+    }
+
+public:
+    EpollEventLoop(int listen_socket, Router& r, ThreadPool& p) : epoll_fd(-1), listen_fd(listen_socket), router(r), pool(p) {}
+
+    ~EpollEventLoop() {
+        if (epoll_fd >= 0) close(epoll_fd);
+    }
+
+    bool init() override {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0) {
+            perror("epoll_create1");
+            return false;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = nullptr; // nullptr نشان‌دهنده سوکت شنونده است
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+            perror("epoll_ctl listen");
+            return false;
+        }
+        return true;
+    }
+
+    void run() override {
+        vector<struct epoll_event> events(MAX_EVENTS);
+        while (true) {
+            int ready = epoll_wait(epoll_fd, events.data(), MAX_EVENTS, next_timeout_ms());
+            if (ready < 0) {
+                if (errno == EINTR) continue;
+                perror("epoll_wait");
+                return;
+            }
+            for (int i = 0; i < ready; ++i) {
+                if (events[i].data.ptr == nullptr) {
+                    accept_connections();
+                } else {
+                    dispatch(static_cast<EpollConnection*>(events[i].data.ptr));
+                }
+            }
+            expire_timers();
+        }
+    }
+};
+
+
+// ----------------------------------------------------------------------
+// --- ۷. موتور I/O مبتنی بر io_uring (اختیاری، با بازگشت به epoll) ---
+// ----------------------------------------------------------------------
+
+// پوشش حداقلی روی syscallهای io_uring (بدون وابستگی به liburing).
+// SQEها در حلقه جمع می‌شوند و با یک io_uring_enter هم ارسال و هم منتظر CQEها می‌شویم.
+class IoUring {
+private:
+    int ring_fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ring_ptr;
+    size_t sq_ring_size;
+    void* cq_ring_ptr;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned local_sq_tail; // SQEهای آماده شده که هنوز به کرنل اعلام نشده‌اند
+    unsigned submitted_tail;
+
+public:
+    IoUring() : ring_fd(-1), sq_head(nullptr), sq_tail(nullptr), sq_mask(nullptr), sq_array(nullptr), sq_entries(0),
+                sqes(nullptr), cq_head(nullptr), cq_tail(nullptr), cq_mask(nullptr), cqes(nullptr),
+                sq_ring_ptr(MAP_FAILED), sq_ring_size(0), cq_ring_ptr(MAP_FAILED), cq_ring_size(0), sqes_size(0),
+                local_sq_tail(0), submitted_tail(0) {}
+
+    ~IoUring() {
+        if (sqes) munmap(sqes, sqes_size);
+        if (cq_ring_ptr != MAP_FAILED && cq_ring_ptr != sq_ring_ptr) munmap(cq_ring_ptr, cq_ring_size);
+        if (sq_ring_ptr != MAP_FAILED) munmap(sq_ring_ptr, sq_ring_size);
+        if (ring_fd >= 0) close(ring_fd);
+    }
+
+    bool init(unsigned entries) {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+        params.cq_entries = entries * 4;
+        ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0 && errno == EINVAL) {
+            // کرنل‌های قدیمی‌تر COOP_TASKRUN را نمی‌شناسند
+            memset(&params, 0, sizeof(params));
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = entries * 4;
+            ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        }
+        if (ring_fd < 0) return false;
+        if (!(params.features & IORING_FEAT_NODROP)) return false;
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+        }
+
+        sq_ring_ptr = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring_ptr == MAP_FAILED) return false;
+        if (single_mmap) {
+            cq_ring_ptr = sq_ring_ptr;
+        } else {
+            cq_ring_ptr = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (cq_ring_ptr == MAP_FAILED) return false;
+        }
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        void* sqes_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes_ptr == MAP_FAILED) return false;
+        sqes = static_cast<struct io_uring_sqe*>(sqes_ptr);
+
+        char* sq = static_cast<char*>(sq_ring_ptr);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sq_entries = params.sq_entries;
+
+        char* cq = static_cast<char*>(cq_ring_ptr);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        local_sq_tail = submitted_tail = *sq_tail;
+        return true;
+    }
+
+    // گرفتن یک SQE خالی؛ اگر صف پر باشد ابتدا SQEهای موجود ارسال می‌شوند
+    struct io_uring_sqe* get_sqe() {
+        while (true) {
+            unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            if (local_sq_tail - head < sq_entries) break;
+            if (submit_and_wait(0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) return nullptr;
+        }
+        unsigned index = local_sq_tail & *sq_mask;
+        struct io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        ++local_sq_tail;
+        return sqe;
+    }
+
+    // ارسال تمام SQEهای جمع شده و (در صورت wait_nr > 0) انتظار برای CQEها در یک syscall
+    int submit_and_wait(unsigned wait_nr) {
+        __atomic_store_n(sq_tail, local_sq_tail, __ATOMIC_RELEASE);
+        unsigned to_submit = local_sq_tail - submitted_tail;
+        unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+        int rc = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr, flags, nullptr, 0);
+        if (rc > 0) submitted_tail += rc;
+        return rc;
+    }
+
+    // پردازش تمام CQEهای آماده؛ head پس از هر CQE جلو می‌رود تا کرنل فضای خالی داشته باشد
+    template <typename F>
+    void drain_completions(F on_completion) {
+        unsigned head = *cq_head;
+        while (true) {
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            if (head == tail) break;
+            struct io_uring_cqe cqe = cqes[head & *cq_mask];
+            ++head;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            on_completion(cqe);
+        }
+    }
+
+    int register_op(unsigned opcode, void* arg, unsigned nr_args) {
+        return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+    }
+
+    bool supports_ops(const vector<int>& opcodes) {
+        const unsigned probe_ops = 256;
+        vector<char> storage(sizeof(struct io_uring_probe) + probe_ops * sizeof(struct io_uring_probe_op), 0);
+        struct io_uring_probe* probe = reinterpret_cast<struct io_uring_probe*>(storage.data());
+        if (register_op(IORING_REGISTER_PROBE, probe, probe_ops) < 0) return false;
+        for (int op : opcodes) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+        }
+        return true;
+    }
+};
+
+// گروه بافرهای فراهم‌شده (provided buffers): حافظه یک‌بار به کرنل سپرده می‌شود و کرنل برای هر recv
+// چندباره یکی از بافرها را انتخاب می‌کند، پس نیازی به یک بافر ثابت برای هر اتصال بیکار نیست.
+// بازگرداندن بافر یک SQE از نوع PROVIDE_BUFFERS است که همراه بقیه SQEهای همان دور ارسال می‌شود.
+class UringBufferPool {
+private:
+    char* storage;
+    size_t storage_size;
+    unsigned count;
+    unsigned buffer_size;
+
+public:
+    static const unsigned short GROUP_ID = 0;
+
+    UringBufferPool() : storage(nullptr), storage_size(0), count(0), buffer_size(0) {}
+
+    ~UringBufferPool() {
+        if (storage) munmap(storage, storage_size);
+    }
+
+    bool init(unsigned buffer_count, unsigned size) {
+        count = buffer_count;
+        buffer_size = size;
+        storage_size = (size_t)count * buffer_size;
+        void* storage_ptr = mmap(nullptr, storage_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (storage_ptr == MAP_FAILED) return false;
+        storage = static_cast<char*>(storage_ptr);
+        return true;
+    }
+
+    const char* data(unsigned short buffer_id) const {
+        return storage + (size_t)buffer_id * buffer_size;
+    }
+
+    // آماده‌سازی SQE برای سپردن nbufs بافر متوالی (از first_id) به کرنل
+    void prepare_provide(struct io_uring_sqe* sqe, unsigned short first_id, unsigned nbufs) const {
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = nbufs;
+        sqe->addr = reinterpret_cast<uint64_t>(data(first_id));
+        sqe->len = buffer_size;
+        sqe->off = first_id;
+        sqe->buf_group = GROUP_ID;
+    }
+
+    unsigned size() const { return count; }
+};
+
+class UringEventLoop;
+
+// اتصال مدیریت شده توسط io_uring: recv چندباره و ارسال‌ها در نخ حلقه انجام می‌شوند و نخ پردازشگر
+// فقط با بافرهای ورودی/خروجی محافظت‌شده با io_mutex کار می‌کند. هم‌ترازی ۱۶ چهار بیت پایین آدرس را
+// برای برچسب عملیات در user_data آزاد می‌گذارد.
+class alignas(16) UringConnection : public Connection {
+public:
+    UringEventLoop* loop;
+
+    mutex io_mutex;
+    string incoming;          // داده‌های دریافتی که هنوز به نخ پردازشگر تحویل نشده‌اند
+    OutputQueue out_queue;    // تکه‌های منتظر ارسال توسط حلقه؛ بدون کپی از output نخ پردازشگر منتقل می‌شوند
+    bool peer_closed;         // recv صفر یا خطا برگرداند
+    bool io_failed;           // ارسال با خطا مواجه شد یا مهلت آن تمام شد
+    bool busy;                // یک نخ پردازشگر مالک اتصال است
+    bool waiting_for_send;    // نخ پردازشگر به خاطر پر بودن out_queue اتصال را رها کرده؛ حلقه پس از ارسال ادامه می‌دهد
+    bool close_requested;     // نخ پردازشگر بستن اتصال را درخواست کرده است
+    bool recv_paused;         // incoming از سقف گذشته؛ حلقه پس از تخلیه آن recv را دوباره مسلح می‌کند
+
+    // فقط توسط نخ حلقه استفاده می‌شوند
+    bool recv_armed;
+    bool send_in_flight;
+    bool file_read_in_flight;
+    bool shutdown_done;
+    bool queued_for_loop;     // محافظت‌شده با pending_mutex حلقه
+    unique_ptr<char[]> file_buffer; // مقصد READ بازه‌های فایل؛ فقط برای اتصالی که فایل می‌فرستد ساخته می‌شود
+    struct iovec send_iov[SEND_IOV_BATCH];
+    struct msghdr send_msg;
+
+    UringConnection(int socket_fd, uint32_t ip, UringEventLoop* owner)
+        : Connection(socket_fd, ip), loop(owner), peer_closed(false), io_failed(false), busy(false),
+          waiting_for_send(false), close_requested(false), recv_paused(false), recv_armed(false),
+          send_in_flight(false), file_read_in_flight(false), shutdown_done(false), queued_for_loop(false) {
+        memset(&send_msg, 0, sizeof(send_msg));
+        send_msg.msg_iov = send_iov;
+    }
+};
+
+// حلقه رویداد io_uring: accept و recv چندباره (multishot)، بافرهای فراهم‌شده برای دریافت،
+// و ارسال‌های دسته‌ای با SENDMSG مستقیم از تکه‌های صف خروجی. بازه‌های فایل با READ به بافر اتصال
+// خوانده و سپس ارسال می‌شوند، پس هیچ نخ پردازشگری منتظر سوکت نمی‌ماند. تمام SQEهای تولید شده در یک
+// دور با یک io_uring_enter ارسال می‌شوند.
+class UringEventLoop : public EventLoop {
+private:
+    enum OpTag : uint64_t {
+        OP_ACCEPT = 1, OP_RECV = 2, OP_SEND = 3, OP_WAKE = 4, OP_PROVIDE = 5, OP_TIMER = 6, OP_CANCEL = 7,
+        OP_FILE_READ = 8
+    };
+    static const uint64_t TAG_MASK = 15;
+    static_assert(alignof(UringConnection) > TAG_MASK, "برچسب عملیات در بیت‌های پایین آدرس اتصال جا نمی‌شود");
+
+    IoUring uring;
+    UringBufferPool buffers;
+    int listen_fd;
+    int wake_fd;
+    uint64_t wake_value;
+    Router& router;
+    ThreadPool& pool;
+
+    mutex pending_mutex;
+    vector<UringConnection*> pending; // اتصال‌هایی که ارسال، بستن یا بیکار شدن جدید دارند
+    atomic<bool> wake_pending;
+
+    // فقط نخ حلقه از چرخ استفاده می‌کند؛ اتصالی در آن است که نه نخ پردازشگر دارد و نه بسته شده است
+    TimerWheel timers;
+    struct __kernel_timespec tick_timeout;
+    bool timer_armed;
+
+    static uint64_t encode(UringConnection* conn, OpTag tag) {
+        return reinterpret_cast<uint64_t>(conn) | tag;
+    }
+
+    struct io_uring_sqe* sqe_for(uint64_t user_data) {
+        struct io_uring_sqe* sqe = uring.get_sqe();
+        if (sqe) sqe->user_data = user_data;
+        return sqe;
+    }
+
+    void arm_accept() {
+        struct io_uring_sqe* sqe = sqe_for(OP_ACCEPT);
+        if (!sqe) return;
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listen_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+
+    void arm_wake() {
+        struct io_uring_sqe* sqe = sqe_for(OP_WAKE);
+        if (!sqe) return;
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = wake_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&wake_value);
+        sqe->len = sizeof(wake_value);
+        sqe->off = (uint64_t)-1;
+    }
+
+    // بازگرداندن بافر به گروه؛ CQE فقط در صورت خطا تولید می‌شود
+    void recycle_buffer(unsigned short buffer_id) {
+        struct io_uring_sqe* sqe = sqe_for(OP_PROVIDE);
+        if (!sqe) return;
+        buffers.prepare_provide(sqe, buffer_id, 1);
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    }
+
+    // IORING_OP_TIMEOUT برای بیدار شدن در تیک بعدی چرخ، فقط وقتی زمان‌سنج فعالی وجود دارد
+    void arm_timer() {
+        if (timer_armed || timers.empty()) return;
+        struct io_uring_sqe* sqe = sqe_for(OP_TIMER);
+        if (!sqe) return;
+        tick_timeout.tv_sec = 0;
+        tick_timeout.tv_nsec = max(timers.poll_timeout_ms(monotonic_ms()), 1) * 1000000LL;
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = reinterpret_cast<uint64_t>(&tick_timeout);
+        sqe->len = 1;
+        sqe->off = 0;
+        timer_armed = true;
+    }
+
+    // تا صف خروجی خالی نشده مهلت نوشتن (با هر ارسال موفق از نو)، سپس مهلت مرحله‌ای که نخ پردازشگر
+    // پیش از رها کردن اتصال تعیین کرده است
+    bool output_pending(UringConnection* conn) {
+        lock_guard<mutex> lock(conn->io_mutex);
+        return !conn->out_queue.empty();
+    }
+
+    // فراخوانی با io_mutex: اتصال بدون نخ پردازشگر که منتظر ورودی یا ارسال است (از جمله اتصالی که
+    // بستنش تا تخلیه صف خروجی به تعویق افتاده)
+    static bool needs_timer(const UringConnection* conn) {
+        return !conn->busy && !conn->io_failed && (!conn->close_requested || !conn->out_queue.empty());
+    }
+
+    void schedule_idle_timer(UringConnection* conn) {
+        uint64_t now = monotonic_ms();
+        uint64_t timeout = output_pending(conn) ? server_config.write_timeout_ms : connection_timeout_ms(*conn, now);
+        timers.schedule(&conn->idle_timer, now, timeout);
+    }
+
+    // بستن اتصال‌های بیکاری که مهلتشان تمام شده است (مثل بستن درخواستی نخ پردازشگر)
+    void expire_timers() {
+        timers.advance(monotonic_ms(), [this](TimerNode* node) {
+            UringConnection* conn = static_cast<UringConnection*>(node->owner);
+            ConnectionPhase phase;
+            {
+                lock_guard<mutex> lock(conn->io_mutex);
+                if (!needs_timer(conn)) return;
+                conn->close_requested = true;
+                phase = conn->phase;
+                if (!conn->out_queue.empty()) {
+                    // کلاینت نمی‌خواند: باقی صف دور ریخته می‌شود و shutdown ارسال معلق را خاتمه می‌دهد
+                    phase = ConnectionPhase::WRITE;
+                    conn->io_failed = true;
+                }
+            }
+            metrics.connection_timed_out((size_t)phase);
+            maybe_finalize(conn);
+        });
+    }
+
+    void arm_recv(UringConnection* conn) {
+        struct io_uring_sqe* sqe = sqe_for(encode(conn, OP_RECV));
+        if (!sqe) return;
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn->fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = UringBufferPool::GROUP_ID;
+        conn->recv_armed = true;
+    }
+
+    // مسلح کردن دوباره recv پس از پایان recv چندباره، مگر ورودی تحویل‌نشده هنوز بیش از سقف باشد؛
+    // در آن صورت نخ پردازشگر پس از تخلیه incoming اتصال را به حلقه می‌فرستد
+    void rearm_recv(UringConnection* conn) {
+        if (conn->recv_armed || conn->shutdown_done) return;
+        {
+            lock_guard<mutex> lock(conn->io_mutex);
+            conn->recv_paused = conn->incoming.size() >= URING_MAX_INCOMING;
+            if (conn->recv_paused) return;
+        }
+        arm_recv(conn);
+    }
+
+    // توقف recv چندباره فعال؛ CQE نهایی آن با ECANCELED می‌رسد
+    void cancel_recv(UringConnection* conn) {
+        struct io_uring_sqe* sqe = sqe_for(OP_CANCEL);
+        if (!sqe) return;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = encode(conn, OP_RECV);
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    }
+
+    // ارسال ابتدای صف خروجی: تکه‌های حافظه با یک SENDMSG (scatter-gather) مستقیم از حافظه خود تکه‌ها،
+    // که تا رسیدن CQE در صف می‌مانند. اگر جلوی صف بازه فایل باشد، قطعه بعدی آن با READ به بافر اتصال
+    // خوانده می‌شود و پس از تکمیل مثل تکه حافظه ارسال می‌شود. پیش از بازه فایل MSG_MORE داده می‌شود.
+    void flush_sends(UringConnection* conn) {
+        if (conn->send_in_flight || conn->file_read_in_flight || conn->shutdown_done) return;
+        lock_guard<mutex> lock(conn->io_mutex);
+        if (conn->io_failed || conn->out_queue.empty()) return;
+        OutputSegment& front = conn->out_queue.front();
+        if (front.is_file()) {
+            struct io_uring_sqe* sqe = sqe_for(encode(conn, OP_FILE_READ));
+            if (!sqe) return;
+            if (!conn->file_buffer) conn->file_buffer.reset(new char[URING_FILE_READ_SIZE]);
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = front.file_fd;
+            sqe->addr = reinterpret_cast<uint64_t>(conn->file_buffer.get());
+            sqe->len = min(front.length, URING_FILE_READ_SIZE);
+            sqe->off = front.offset;
+            conn->file_read_in_flight = true;
             return;
         }
-        
-        outfile.write(buffer.data(), bytes_read);
-        remaining_to_read -= bytes_read;
+        struct io_uring_sqe* sqe = sqe_for(encode(conn, OP_SEND));
+        if (!sqe) return;
+        bool more = false;
+        conn->send_msg.msg_iovlen = conn->out_queue.gather(conn->send_iov, SEND_IOV_BATCH, more);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn->fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&conn->send_msg);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+        conn->send_in_flight = true;
     }
-    
-    outfile.close();
-
-    log_message("فایل ذخیره شد: " + filename); 
-    string response_str = build_http_response("{\"message\": \"File uploaded successfully to " + filename + "\"}", 200, "application/json");
-    send(client_socket, response_str.c_str(), response_str.length(), 0);
-}
 
+    // بستن اتصال پس از تخلیه صف خروجی (یا خطا/مهلت نوشتن): ابتدا shutdown تا recv چندباره و ارسال
+    // معلق خاتمه یابند، سپس پس از رسیدن CQE همه عملیات‌ها close و آزادسازی
+    void maybe_finalize(UringConnection* conn) {
+        if (!conn->close_requested) return;
+        {
+            lock_guard<mutex> lock(conn->io_mutex);
+            if (!conn->io_failed && !conn->out_queue.empty()) return;
+        }
+        if (!conn->shutdown_done) {
+            conn->shutdown_done = true;
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+        if (conn->recv_armed || conn->send_in_flight || conn->file_read_in_flight) return;
+        timers.cancel(&conn->idle_timer);
+        {
+            // ممکن است اتصال هنوز در فهرست کارهای منتظر حلقه باشد (post قبل از تخلیه صف)
+            lock_guard<mutex> lock(pending_mutex);
+            if (conn->queued_for_loop) {
+                pending.erase(remove(pending.begin(), pending.end(), conn), pending.end());
+            }
+        }
+        close(conn->fd);
+        delete conn;
+    }
 
-// ----------------------------------------------------------------------
-// --- ۴. هندلرهای ماژولار (CRUD) ---
-// ----------------------------------------------------------------------
-
-// R - Read All Users
-string api_users_get_handler(const string& method, const string& path, const map<string, string>& headers, const string& body, int client_socket) {
-    vector<map<string, string>> users;
-    
-    if (!db_manager->execute_query("SELECT id, name, email FROM users;", users)) {
-        return build_http_response("{\"error\": \"Failed to retrieve users from database.\"}", 500, "application/json");
+    void schedule(UringConnection* conn) {
+        pool.submit([this, conn] { process_connection(conn); });
     }
 
-    string all_users_json = "[\n";
-    for (size_t i = 0; i < users.size(); ++i) {
-        all_users_json += JsonParser::stringify(users[i]);
-        if (i < users.size() - 1) {
-            all_users_json += ",\n";
+    void on_accept(const struct io_uring_cqe& cqe) {
+        if (cqe.res >= 0) {
+            // accept چندباره آدرس کلاینت را برنمی‌گرداند
+            struct sockaddr_in peer = {};
+            socklen_t peer_length = sizeof(peer);
+            getpeername(cqe.res, (struct sockaddr*)&peer, &peer_length);
+            AdmissionVerdict verdict = admission.try_admit(peer.sin_addr.s_addr, pool.queue_depth());
+            if (verdict != AdmissionVerdict::ADMIT) {
+                admission.reject(cqe.res, verdict);
+                if (!(cqe.flags & IORING_CQE_F_MORE)) arm_accept();
+                return;
+            }
+            UringConnection* conn = new UringConnection(cqe.res, peer.sin_addr.s_addr, this);
+            arm_recv(conn);
+            schedule_idle_timer(conn);
+        } else if (cqe.res != -EAGAIN && cqe.res != -EINTR) {
+            log_message(LogLevel::ERROR, "خطا در accept (io_uring): " + string(strerror(-cqe.res)));
         }
+        if (!(cqe.flags & IORING_CQE_F_MORE)) arm_accept();
     }
-    all_users_json += "\n]";
-    
-    return build_http_response(all_users_json, 200, "application/json"); 
-}
 
-// C - Create New User
-string api_users_post_handler(const string& method, const string& path, const map<string, string>& headers, const string& body, int client_socket) {
-    try {
-        map<string, string> new_user_data = JsonParser::parse(body);
-        
-        if (new_user_data.count("name") && new_user_data.count("email") && new_user_data.at("email").find('@') != string::npos) {
-            
-            string name = new_user_data.at("name");
-            string email = new_user_data.at("email");
-            
-            // کوئری INSERT با Prepared Statements (بسیار امن‌تر)
-            string sql = "INSERT INTO users (name, email) VALUES (?, ?);";
-            vector<string> params = {name, email};
-            
-            if (db_manager->prepare_and_execute(sql, params)) {
-                
-                // دریافت آخرین ID ایجاد شده
-                long new_id = db_manager->get_last_insert_id();
+    void on_recv(UringConnection* conn, const struct io_uring_cqe& cqe) {
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        if (!more) conn->recv_armed = false;
 
-                new_user_data["id"] = to_string(new_id);
-                string response_json = JsonParser::stringify(new_user_data);
+        if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+            unsigned short buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            bool need_worker = false;
+            bool over_limit = false;
+            {
+                lock_guard<mutex> lock(conn->io_mutex);
+                if (!conn->close_requested) {
+                    conn->incoming.append(buffers.data(buffer_id), cqe.res);
+                    // نخ پردازشگر منتظر تخلیه صف خروجی پس از ارسال ورودی را هم برمی‌دارد
+                    need_worker = !conn->busy && !conn->waiting_for_send;
+                    if (need_worker) conn->busy = true;
+                    // همان سقف حلقه epoll: کلاینتی که سریع‌تر از نخ پردازشگر می‌فرستد حافظه را پر نمی‌کند
+                    over_limit = conn->incoming.size() >= URING_MAX_INCOMING;
+                    if (over_limit && more && !conn->recv_paused) {
+                        conn->recv_paused = true;
+                        cancel_recv(conn);
+                    }
+                }
+            }
+            recycle_buffer(buffer_id);
+            if (need_worker) {
+                timers.cancel(&conn->idle_timer);
+                schedule(conn);
+            }
+            if (!more) rearm_recv(conn);
+        } else if (cqe.res == -ENOBUFS && !conn->shutdown_done) {
+            // همه بافرها موقتاً در حال استفاده بودند؛ recv دوباره مسلح می‌شود
+            if (!more) rearm_recv(conn);
+        } else if (cqe.res == -ECANCELED && conn->recv_paused && !conn->shutdown_done) {
+            // لغو به خاطر پر بودن incoming؛ اگر در این فاصله تخلیه شده باشد بلافاصله ادامه می‌دهیم
+            rearm_recv(conn);
+        } else if (!more) {
+            // EOF، خطا یا لغو پس از shutdown
+            bool need_worker = false;
+            {
+                lock_guard<mutex> lock(conn->io_mutex);
+                conn->peer_closed = true;
+                if (!conn->close_requested && !conn->busy && !conn->waiting_for_send) {
+                    conn->busy = true;
+                    need_worker = true;
+                }
+            }
+            if (need_worker) {
+                timers.cancel(&conn->idle_timer);
+                schedule(conn);
+            }
+        }
+        maybe_finalize(conn);
+    }
 
-                log_message("کاربر جدید در دیتابیس ایجاد شد: ID " + new_user_data.at("id"));
-                return build_http_response(response_json, 201, "application/json");
+    // پیشرفت ارسال: مهلت نوشتن از نو شروع می‌شود و اگر نخ پردازشگر به خاطر پر بودن صف کنار رفته
+    // باشد، با رسیدن صف به زیر URING_SEND_HIGH_WATERMARK دوباره به استخر سپرده می‌شود
+    void after_send_progress(UringConnection* conn) {
+        bool resume = false;
+        bool idle = false;
+        {
+            lock_guard<mutex> lock(conn->io_mutex);
+            if (conn->io_failed && !conn->busy) {
+                conn->waiting_for_send = false;
+                conn->close_requested = true;
+            } else if (conn->waiting_for_send && !conn->close_requested &&
+                       conn->out_queue.bytes() < URING_SEND_HIGH_WATERMARK) {
+                conn->waiting_for_send = false;
+                conn->busy = true;
+                resume = true;
+            }
+            idle = needs_timer(conn);
+        }
+        if (resume) {
+            timers.cancel(&conn->idle_timer);
+            schedule(conn);
+        } else if (idle) {
+            schedule_idle_timer(conn);
+        }
+        flush_sends(conn);
+        maybe_finalize(conn);
+    }
 
+    void on_send(UringConnection* conn, const struct io_uring_cqe& cqe) {
+        conn->send_in_flight = false;
+        {
+            lock_guard<mutex> lock(conn->io_mutex);
+            if (cqe.res < 0) {
+                conn->io_failed = true;
+                conn->out_queue.clear();
             } else {
-                return build_http_response("{\"error\": \"Database insertion failed (Email might be duplicate, UNIQUE constraint violation).\"}", 500, "application/json");
+                conn->out_queue.consume(cqe.res);
             }
-        } else {
-            return build_http_response("{\"error\": \"Name and a valid email are required.\"}", 400, "application/json");
         }
-    } catch (const exception& e) {
-        return build_http_response("{\"error\": \"Invalid JSON format or input: " + string(e.what()) + "\"}", 400, "application/json");
+        after_send_progress(conn);
     }
-}
 
-// U - Update Existing User
-string api_users_put_handler(const string& method, const string& path, const map<string, string>& headers, const string& body, int client_socket) {
-    try {
-        // ۱. استخراج ID از مسیر: PUT /api/users/5
-        size_t id_start = path.find_last_of('/') + 1;
-        if (id_start == 0 || id_start >= path.length()) {
-            return build_http_response("{\"error\": \"User ID is missing from URL.\"}", 400, "application/json");
+    // قطعه‌ای از بازه فایل جلوی صف در file_buffer خوانده شد؛ فایل کوتاه‌شده (READ صفر) خطاست
+    void on_file_read(UringConnection* conn, const struct io_uring_cqe& cqe) {
+        conn->file_read_in_flight = false;
+        {
+            lock_guard<mutex> lock(conn->io_mutex);
+            if (cqe.res <= 0 || conn->io_failed) {
+                if (cqe.res < 0) log_message(LogLevel::ERROR, "خطا در خواندن فایل (io_uring): " + string(strerror(-cqe.res)));
+                conn->io_failed = true;
+                conn->out_queue.clear();
+            } else {
+                conn->out_queue.stage_file_front(conn->file_buffer.get(), cqe.res);
+            }
         }
-        string id_str = path.substr(id_start);
-        
-        // ۲. تجزیه بدنه JSON
-        map<string, string> update_data = JsonParser::parse(body);
-        
-        if (!(update_data.count("name") || update_data.count("email"))) {
-            return build_http_response("{\"error\": \"Require 'name' or 'email' field to update.\"}", 400, "application/json");
+        after_send_progress(conn);
+    }
+
+    void on_wake() {
+        wake_pending.store(false);
+        vector<UringConnection*> ready;
+        {
+            lock_guard<mutex> lock(pending_mutex);
+            ready.swap(pending);
+            for (UringConnection* conn : ready) {
+                conn->queued_for_loop = false;
+            }
         }
-        
-        // ۳. ساخت کوئری UPDATE پویا با Prepared Statements
-        string sql = "UPDATE users SET ";
-        vector<string> params;
-        
-        if (update_data.count("name")) {
-            sql += "name = ?, ";
-            params.push_back(update_data.at("name"));
+        arm_wake();
+        for (UringConnection* conn : ready) {
+            bool idle;
+            {
+                lock_guard<mutex> lock(conn->io_mutex);
+                idle = needs_timer(conn);
+            }
+            if (idle) schedule_idle_timer(conn); // نخ پردازشگر کارش را تمام کرده است
+            if (conn->recv_paused) rearm_recv(conn);
+            flush_sends(conn);
+            maybe_finalize(conn);
         }
-        if (update_data.count("email")) {
-            sql += "email = ?, ";
-            params.push_back(update_data.at("email"));
+    }
+
+    void handle_completion(const struct io_uring_cqe& cqe) {
+        uint64_t tag = cqe.user_data & TAG_MASK;
+        UringConnection* conn = reinterpret_cast<UringConnection*>(cqe.user_data & ~TAG_MASK);
+        switch (tag) {
+            case OP_ACCEPT: on_accept(cqe); break;
+            case OP_RECV: on_recv(conn, cqe); break;
+            case OP_SEND: on_send(conn, cqe); break;
+            case OP_FILE_READ: on_file_read(conn, cqe); break;
+            case OP_WAKE: on_wake(); break;
+            case OP_TIMER: timer_armed = false; break; // چرخ پس از هر دور در run جلو برده می‌شود
+            case OP_CANCEL: break; // recv ممکن است پیش از لغو تمام شده باشد (ENOENT)
+            case OP_PROVIDE:
+                if (cqe.res < 0) log_message(LogLevel::ERROR, "خطا در بازگرداندن بافر io_uring: " + string(strerror(-cqe.res)));
+                break;
         }
-        
-        // حذف کامای اضافی و اضافه کردن شرط WHERE
-        sql = sql.substr(0, sql.length() - 2); 
-        sql += " WHERE id = ?;";
-        params.push_back(id_str);
+    }
 
-        if (db_manager->prepare_and_execute(sql, params)) {
-            log_message("کاربر با ID " + id_str + " به‌روزرسانی شد.");
-            return build_http_response("{\"message\": \"User " + id_str + " updated successfully.\"}", 200, "application/json");
-        } else {
-            return build_http_response("{\"error\": \"Database update failed (ID not found or Email is duplicate).\"}", 500, "application/json");
+    // اجرا در نخ پردازشگر: داده‌های رسیده را به بافر اتصال منتقل و درخواست‌ها را پیش می‌برد. خروجی
+    // بدون کپی به صف حلقه سپرده می‌شود و نخ هرگز منتظر ارسال نمی‌ماند: اگر صف از
+    // URING_SEND_HIGH_WATERMARK بگذرد اتصال رها می‌شود و حلقه پس از ارسال آن را دوباره به استخر می‌سپارد.
+    void process_connection(UringConnection* conn) {
+        const size_t max_buffered = MAX_HEADER_SIZE + MAX_BUFFERED_BODY;
+        bool need_input = false; // دور اول درخواست‌های بافرشده را بدون انتظار برای ورودی پیش می‌برد
+        while (true) {
+            bool need_post = false;
+            {
+                unique_lock<mutex> lock(conn->io_mutex);
+                need_post = !conn->output.empty();
+                conn->output.move_to(conn->out_queue);
+                if (conn->io_failed || conn->close_after_output) {
+                    conn->close_requested = true; // حلقه پس از تخلیه صف می‌بندد
+                    break;
+                }
+                bool send_backlog = conn->out_queue.bytes() >= URING_SEND_HIGH_WATERMARK;
+                if (!send_backlog && !conn->incoming.empty()) {
+                    conn->in_buffer.append(conn->incoming.data(), conn->incoming.length());
+                    conn->incoming.clear();
+                    need_input = false;
+                    if (conn->recv_paused) need_post = true; // حلقه recv متوقف‌شده را دوباره مسلح می‌کند
+                } else if (send_backlog || need_input) {
+                    if (!send_backlog && conn->peer_closed) {
+                        conn->close_requested = true;
+                        break;
+                    }
+                    // حلقه ارسال و زمان‌سنج مرحله بعدی را تنظیم می‌کند. ثبت پیش از رها کردن قفل لازم است:
+                    // پس از آن اتصال ممکن است به نخ دیگری برسد، بسته و آزاد شود
+                    conn->busy = false;
+                    conn->waiting_for_send = send_backlog;
+                    bool need_wake = enqueue(conn);
+                    lock.unlock();
+                    if (need_wake) wake();
+                    return;
+                }
+            }
+            if (need_post) post(conn);
+            RequestProgress progress = process_buffered_requests(*conn, router);
+            need_input = progress == RequestProgress::NEED_INPUT;
+            if (progress == RequestProgress::CLOSE || (need_input && conn->in_buffer.size() >= max_buffered)) {
+                lock_guard<mutex> lock(conn->io_mutex);
+                conn->close_requested = true;
+                break;
+            }
         }
+        post(conn); // پس از این فراخوانی اتصال ممکن است توسط حلقه آزاد شود
+    }
 
-    } catch (const exception& e) {
-        return build_http_response("{\"error\": \"Invalid JSON format or URL structure: " + string(e.what()) + "\"}", 400, "application/json");
+public:
+
+
+    UringEventLoop(int listen_socket, Router& r, ThreadPool& p)
+        : listen_fd(listen_socket), wake_fd(-1), wake_value(0), router(r), pool(p), wake_pending(false),
+          tick_timeout{}, timer_armed(false) {}
+
+    ~UringEventLoop() {
+        if (wake_fd >= 0) close(wake_fd);
     }
-}
 
-// Handler برای شمارنده (تست Atomic)
-string count_get_handler(const string& method, const string& path, const map<string, string>& headers, const string& body, int client_socket) {
-    int current_count = ++counter; 
-    return build_http_response("<h1>شمارنده</h1><p>صفحه " + to_string(current_count) + " بار بازدید شده است.</p>", 200);
-}
+    // بررسی پشتیبانی کرنل: accept/recv چندباره (لینوکس ۶.۰+) و بافرهای فراهم‌شده
+    static bool is_supported() {
+        struct utsname info;
+        int major = 0, minor = 0;
+        if (uname(&info) != 0 || sscanf(info.release, "%d.%d", &major, &minor) != 2 || major < 6) {
+            return false;
+        }
+        IoUring probe_ring;
+        if (!probe_ring.init(8)) return false;
+        return probe_ring.supports_ops({IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_READ,
+                                        IORING_OP_PROVIDE_BUFFERS, IORING_OP_TIMEOUT,
+                                        IORING_OP_ASYNC_CANCEL});
+    }
 
-// Handler برای صفحه File Manager
-string files_get_handler(const string& method, const string& path, const map<string, string>& headers, const string& body, int client_socket) {
-    return build_http_response(list_files(UPLOAD_ROOT), 200);
-}
+    bool init() override {
+        if (!uring.init(URING_ENTRIES)) {
+            log_message(LogLevel::ERROR, "خطا در راه‌اندازی io_uring: " + string(strerror(errno)));
+            return false;
+        }
+        if (!buffers.init(URING_BUFFER_COUNT, URING_BUFFER_SIZE)) {
+            log_message(LogLevel::ERROR, "خطا در تخصیص بافرهای io_uring: " + string(strerror(errno)));
+            return false;
+        }
+        wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (wake_fd < 0) {
+            perror("eventfd");
+            return false;
+        }
+        return true;
+    }
 
-// Handler برای دریافت فایل آپلودی (Streaming)
-string upload_post_handler(const string& method, const string& path, const map<string, string>& headers, const string& body, int client_socket) {
-    if (headers.count("content-length")) {
-        try {
-            long content_length = stol(headers.at("content-length")); 
-            if (content_length > 1024 * 1024 * 500) { // محدودیت ۵۰۰ مگابایت
-                 return build_http_response("{\"error\": \"File size exceeds 500MB limit.\"}", 413, "application/json");
+    void run() override {
+        struct io_uring_sqe* sqe = sqe_for(OP_PROVIDE);
+        if (sqe) buffers.prepare_provide(sqe, 0, buffers.size());
+        arm_accept();
+        arm_wake();
+        while (true) {
+            // یک syscall: ارسال همه SQEهای این دور و انتظار برای حداقل یک CQE
+            int rc = uring.submit_and_wait(1);
+            if (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                perror("io_uring_enter");
+                return;
             }
-            handle_upload_stream(client_socket, body, content_length); 
-            return "SERVED";
-        } catch (const exception& e) {
-            return build_http_response("{\"error\": \"Error processing Content-Length or during streaming: " + string(e.what()) + "\"}", 500, "application/json");
+            uring.drain_completions([this](const struct io_uring_cqe& cqe) { handle_completion(cqe); });
+            expire_timers();
+            arm_timer();
         }
-    } else {
-        return build_http_response("{\"error\": \"Content-Length header is required for upload.\"}", 400, "application/json");
     }
-}
 
-// D - Delete File
-string files_delete_handler(const string& method, const string& path, const map<string, string>& headers, const string& body, int client_socket) {
-    if (path.length() <= 7) {
-        return build_http_response("{\"error\": \"Filename is missing.\"}", 400, "application/json");
+    // فراخوانی از نخ پردازشگر: اتصال کار جدید (ارسال یا بستن) برای حلقه دارد
+    void post(UringConnection* conn) {
+        if (enqueue(conn)) wake();
     }
 
-    string filename_to_delete = path.substr(7);
-    string full_path = UPLOAD_ROOT + "/" + filename_to_delete;
-
-    // کنترل امنیتی: جلوگیری از Directory Traversal
-    if (filename_to_delete.find("..") != string::npos || filename_to_delete.find('/') != string::npos) {
-        return build_http_response("{\"error\": \"Security check failed (Invalid characters or Directory Traversal detected).\"}", 403, "application/json");
+private:
+    // false یعنی اتصال از قبل در فهرست بوده و حلقه بیدار خواهد شد
+    bool enqueue(UringConnection* conn) {
+        lock_guard<mutex> lock(pending_mutex);
+        if (conn->queued_for_loop) return false;
+        conn->queued_for_loop = true;
+        pending.push_back(conn);
+        return true;
     }
 
-    if (remove(full_path.c_str()) != 0) {
-        if (errno == ENOENT) {
-            return build_http_response("{\"error\": \"File not found.\"}", 404, "application/json");
-        } else {
-            log_message("خطا در حذف فایل: " + full_path + " - Error: " + strerror(errno));
-            return build_http_response("{\"error\": \"Could not delete file due to server error.\"}", 500, "application/json");
+    void wake() {
+        if (!wake_pending.exchange(true)) {
+            uint64_t one = 1;
+            if (write(wake_fd, &one, sizeof(one)) < 0) {
+                perror("eventfd write");
+            }
         }
     }
-
-    log_message("فایل حذف شد: " + full_path);
-    return build_http_response("{\"message\": \"File deleted successfully.\"}", 200, "application/json");
-}
-
+};
 
 // ----------------------------------------------------------------------
-// --- ۵. هندلر اصلی کلاینت (ارتباط سوکت) ---
+// --- ۸. توابع پیکربندی و Main ---
 // ----------------------------------------------------------------------
 
-void handle_client(int client_socket, Router& router) {
-    // تنظیم مهلت زمانی (Timeout) برای خواندن
-    struct timeval timeout;
-    timeout.tv_sec = 5; 
-    timeout.tv_usec = 0;
-    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof timeout);
+void print_usage(const char* program) {
+    cerr << "Usage: " << program << " [--workers=N] [--reuseport] [--acceptors=N] [--io=epoll|uring] [--log-level=L] [--access-log=PATH|off]" << endl;
+    cerr << "       [--header-timeout=S] [--body-timeout=S] [--keepalive-timeout=S] [--write-timeout=S]" << endl;
+    cerr << "       [--backlog=N] [--max-connections=N] [--max-per-ip=N] [--shed-queue-depth=N] [--retry-after=S]" << endl;
+    cerr << "       [--db-readers=N] [--db-busy-timeout=MS]" << endl;
+    cerr << "  --workers=N    تعداد نخ‌های پردازشگر (پیش‌فرض: دو برابر هسته‌ها)" << endl;
+    cerr << "  --reuseport    یک سوکت شنونده و حلقه رویداد برای هر هسته؛ کرنل اتصال‌ها را پخش می‌کند" << endl;
+    cerr << "  --acceptors=N  تعداد حلقه‌های پذیرش در حالت reuseport (پیش‌فرض: تعداد CPUها)" << endl;
+    cerr << "  --io=ENGINE    موتور I/O: epoll (پیش‌فرض) یا uring؛ در صورت عدم پشتیبانی به epoll برمی‌گردد" << endl;
+    cerr << "  --log-level=L  حداقل سطح لاگ: debug، info (پیش‌فرض)، warn یا error" << endl;
+    cerr << "  --header-timeout=S     مهلت دریافت کامل هدرهای درخواست به ثانیه (پیش‌فرض: " << HEADER_TIMEOUT_MS / 1000 << ")" << endl;
+    cerr << "  --body-timeout=S       حداکثر فاصله دو دریافت در حین خواندن بدنه (پیش‌فرض: " << BODY_TIMEOUT_MS / 1000 << ")" << endl;
+    cerr << "  --keepalive-timeout=S  حداکثر بیکاری اتصال keep-alive (پیش‌فرض: " << KEEPALIVE_TIMEOUT_MS / 1000 << ")" << endl;
+    cerr << "  --write-timeout=S      حداکثر توقف ارسال وقتی کلاینت نمی‌خواند (پیش‌فرض: " << WRITE_TIMEOUT_MS / 1000 << ")" << endl;
+    cerr << "  --backlog=N            طول صف اتصال‌های در انتظار accept (پیش‌فرض: " << BACKLOG << ")" << endl;
+    cerr << "  --max-connections=N    سقف اتصال‌های باز؛ بیشتر از آن با 503 رد می‌شود (پیش‌فرض: " << MAX_CONNECTIONS << "، 0 = بدون سقف)" << endl;
+    cerr << "  --max-per-ip=N         سقف اتصال‌های باز هر IP (پیش‌فرض: " << MAX_CONNECTIONS_PER_IP << "، 0 = بدون سقف)" << endl;
+    cerr << "  --shed-queue-depth=N   رد اتصال‌های جدید وقتی N کار منتظر نخ است (پیش‌فرض: " << SHED_QUEUE_DEPTH << "، 0 = غیرفعال)" << endl;
+    cerr << "  --retry-after=S        مقدار Retry-After در پاسخ 503 (پیش‌فرض: " << RETRY_AFTER_SECONDS << ")" << endl;
+    cerr << "  --db-readers=N         اتصال‌های فقط‌خواندنی SQLite (پیش‌فرض: " << DB_READ_CONNECTIONS << "؛ 0 = خواندن از اتصال نویسنده)" << endl;
+    cerr << "  --db-busy-timeout=MS   انتظار برای قفل فایل دیتابیس یا اتصال آزاد استخر؛ سپس 503 (پیش‌فرض: " << DB_BUSY_TIMEOUT_MS << ")" << endl;
+    cerr << "  --access-log=P فایل لاگ دسترسی دودویی (پیش‌فرض: " << ACCESS_LOG_PATH << ")؛ off برای خاموش کردن. خواندن با logdecode" << endl;
+}
 
-    vector<char> buffer(BUFFER_SIZE); 
-    long valread;
-    
-    // یک حلقه برای مدیریت Keep-Alive (گرچه HTTP 1.1 معمولاً از یک درخواست در هر اتصال پشتیبانی می‌کند)
-    do { 
-        valread = read(client_socket, buffer.data(), BUFFER_SIZE - 1); 
-        
-        if (valread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            // Timeout یا عدم وجود داده
-            break; 
-        } else if (valread <= 0) {
-            // اتصال بسته شد یا خطا
-            break;
+// مقدار عددی کامل یک گزینه در بازه [min_value, max_value]؛ در غیر این صورت استثنا (مثل stoi).
+// صفر فقط برای گزینه‌هایی مجاز است که معنای مستندی دارد (مثلاً بدون سقف)، چون کارگر صفر یا مهلت
+// منفی سرور را بی‌صدا از کار می‌اندازد
+static int parse_int_option(const string& value, int min_value, int max_value) {
+    int result = 0;
+    auto [end, error] = from_chars(value.data(), value.data() + value.length(), result);
+    if (error != errc() || end != value.data() + value.length() || result < min_value || result > max_value) {
+        throw invalid_argument(value);
+    }
+    return result;
+}
+
+bool parse_arguments(int argc, char* argv[], ServerConfig& config) {
+    const int MAX_TIMEOUT_SECONDS = 3600;
+    const int MAX_LIMIT = 1000000;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        string key = arg.substr(0, eq);
+        string value = (eq != string::npos) ? arg.substr(eq + 1) : "";
+        try {
+            if (key == "--workers" && !value.empty()) {
+                config.worker_threads = parse_int_option(value, 1, 1024);
+            } else if (key == "--reuseport" && value.empty()) {
+                config.reuseport = true;
+            } else if (key == "--acceptors" && !value.empty()) {
+                config.acceptors = parse_int_option(value, 1, 1024);
+                config.reuseport = true;
+            } else if (key == "--io" && (value == "epoll" || value == "uring")) {
+                config.io_engine = value;
+            } else if (key == "--log-level" && value == "debug") {
+                config.log_level = LogLevel::DEBUG;
+            } else if (key == "--log-level" && value == "info") {
+                config.log_level = LogLevel::INFO;
+            } else if (key == "--log-level" && value == "warn") {
+                config.log_level = LogLevel::WARN;
+            } else if (key == "--log-level" && value == "error") {
+                config.log_level = LogLevel::ERROR;
+            } else if (key == "--header-timeout" && !value.empty()) {
+                config.header_timeout_ms = parse_int_option(value, 1, MAX_TIMEOUT_SECONDS) * 1000;
+            } else if (key == "--body-timeout" && !value.empty()) {
+                config.body_timeout_ms = parse_int_option(value, 1, MAX_TIMEOUT_SECONDS) * 1000;
+            } else if (key == "--keepalive-timeout" && !value.empty()) {
+                config.keepalive_timeout_ms = parse_int_option(value, 1, MAX_TIMEOUT_SECONDS) * 1000;
+            } else if (key == "--write-timeout" && !value.empty()) {
+                config.write_timeout_ms = parse_int_option(value, 1, MAX_TIMEOUT_SECONDS) * 1000;
+            } else if (key == "--backlog" && !value.empty()) {
+                config.listen_backlog = parse_int_option(value, 1, 65535);
+            } else if (key == "--max-connections" && !value.empty()) {
+                config.max_connections = parse_int_option(value, 0, MAX_LIMIT);
+            } else if (key == "--max-per-ip" && !value.empty()) {
+                config.max_connections_per_ip = parse_int_option(value, 0, MAX_LIMIT);
+            } else if (key == "--shed-queue-depth" && !value.empty()) {
+                config.shed_queue_depth = parse_int_option(value, 0, MAX_LIMIT);
+            } else if (key == "--retry-after" && !value.empty()) {
+                config.retry_after_seconds = parse_int_option(value, 1, MAX_TIMEOUT_SECONDS);
+            } else if (key == "--db-readers" && !value.empty()) {
+                config.db_readers = parse_int_option(value, 0, 64);
+            } else if (key == "--db-busy-timeout" && !value.empty()) {
+                config.db_busy_timeout_ms = parse_int_option(value, 1, MAX_TIMEOUT_SECONDS * 1000);
+            } else if (key == "--access-log" && !value.empty()) {
+                config.access_log_path = value == "off" ? "" : value;
+            } else {
+                cerr << "آرگومان نامعتبر: " << arg << endl;
+                return false;
+            }
+        } catch (const exception&) {
+            cerr << "مقدار عددی نامعتبر: " << arg << endl;
+            return false;
         }
+    }
+    return true;
+}
 
-        string request(buffer.data(), valread); 
-        
-        size_t first_line_end = request.find("\r\n");
-        size_t headers_end = request.find("\r\n\r\n");
+// ساخت سوکت شنونده non-blocking؛ در حالت reuseport چند سوکت روی یک پورت باز می‌شوند
+int create_listen_socket(bool reuseport) {
+    struct sockaddr_in address;
+    int server_fd;
 
-        if (first_line_end == string::npos || headers_end == string::npos) break;
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket failed");
+        return -1;
+    }
+    
+    // تنظیم سوکت برای استفاده مجدد از آدرس و پورت بلافاصله
+    int opt = 1;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+        perror("setsockopt");
+        close(server_fd);
+        return -1;
+    }
+    if (reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        perror("setsockopt SO_REUSEPORT");
+        close(server_fd);
+        return -1;
+    }
 
-        // تجزیه خط اول (متد و مسیر)
-        string first_line = request.substr(0, first_line_end);
-        size_t method_end = first_line.find(' ');
-        size_t path_start = method_end + 1;
-        size_t path_end = first_line.find(' ', path_start);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY; // گوش دادن روی تمام اینترفیس‌ها
+    address.sin_port = htons(PORT);
         
-        if (method_end == string::npos || path_end == string::npos) break;
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("bind failed");
+        close(server_fd);
+        return -1;
+    }
         
-        string method = first_line.substr(0, method_end);
-        string full_path_with_query = first_line.substr(path_start, path_end - path_start);
-        string path;
-        size_t query_pos = full_path_with_query.find('?');
-        path = (query_pos != string::npos) ? full_path_with_query.substr(0, query_pos) : full_path_with_query;
-
-        log_message("درخواست: " + method + " " + path); 
+    if (listen(server_fd, server_config.listen_backlog) < 0) {
+        perror("listen");
+        close(server_fd);
+        return -1;
+    }
+    return server_fd;
+}
 
-        // تجزیه هدرها
-        map<string, string> headers;
-        string headers_raw = request.substr(first_line_end + 2, headers_end - first_line_end - 2);
-        stringstream ss(headers_raw);
-        string line;
-        while (getline(ss, line, '\r')) {
-            if (line.empty()) continue; 
-            size_t colon = line.find(':');
-            if (colon != string::npos) {
-                string key = line.substr(0, colon);
-                string value = line.substr(colon + 2);
-                if (value.back() == '\n') value.pop_back(); 
-                transform(key.begin(), key.end(), key.begin(), ::tolower);
-                headers[key] = value;
-            }
+// فهرست CPUهایی که فرآیند اجازه اجرا روی آن‌ها را دارد (با در نظر گرفتن cgroup/taskset)
+vector<int> allowed_cpus() {
+    vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
         }
-        string body = request.substr(headers_end + 4); 
+    }
+    if (cpus.empty()) cpus.push_back(0);
+    return cpus;
+}
+
+void pin_thread_to_cpu(thread& t, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rc = pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+    if (rc != 0) {
+        log_message(LogLevel::ERROR, "خطا در تنظیم affinity برای CPU " + to_string(cpu) + ": " + strerror(rc));
+    }
+}
 
-        // مسیریابی و اجرای هندلر
-        string response_str = router.route_request(method, path, headers, body, client_socket); 
+int main(int argc, char* argv[]) {
+    if (!parse_arguments(argc, argv, server_config)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
 
-        // ارسال پاسخ (اگر توسط هندلر قبلاً ارسال نشده باشد، مثل سرویس فایل یا آپلود استریمینگ)
-        if (response_str != "" && response_str != "SERVED") {
-            send(client_socket, response_str.c_str(), response_str.length(), 0);
-        }
-        
-        // اگر Connection: Close در هدرها بود، حلقه می‌شکند (پیاده‌سازی کامل Keep-Alive پیچیده‌تر است)
-        if (headers.count("connection") && headers.at("connection") == "close") {
-            break;
-        }
+    // نوشتن روی سوکتی که کلاینت بسته است نباید کل فرآیند را با SIGPIPE متوقف کند
+    signal(SIGPIPE, SIG_IGN);
 
-    } while (true); 
-    
-    close(client_socket);
-}
+    // هدر Date و زمان لاگ‌ها هر ثانیه یک‌بار در پس‌زمینه قالب‌بندی می‌شوند
+    server_clock.start();
 
+    // لاگ ناهمگام: نخ‌ها فقط در صف خودشان می‌نویسند؛ پیام‌های باقیمانده هنگام خروج تخلیه می‌شوند
+    logger.set_level(server_config.log_level);
+    logger.start();
+    atexit([] { logger.flush(); });
 
-// ----------------------------------------------------------------------
-// --- ۶. Main Function ---
-// ----------------------------------------------------------------------
+    // سقف اتصال‌ها باید زیر محدودیت توصیف‌گرهای فایل بماند؛ وگرنه accept با EMFILE شکست می‌خورد و
+    // کلاینت به جای 503 پاسخی نمی‌گیرد. ۶۴ توصیف‌گر برای فایل‌ها، دیتابیس و لاگ کنار گذاشته می‌شود.
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur != RLIM_INFINITY) {
+        int usable = (int)min<rlim_t>(fd_limit.rlim_cur, INT32_MAX) - 64;
+        if (server_config.max_connections == 0 || server_config.max_connections > usable) {
+            log_message(LogLevel::WARN, "سقف اتصال‌ها به " + to_string(usable) + " محدود شد (RLIMIT_NOFILE = " +
+                                            to_string(fd_limit.rlim_cur) + ").");
+            server_config.max_connections = max(usable, 1);
+        }
+    }
+    admission.init();
 
-int main() {
-    int server_fd, new_socket;
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
-    
     // ۱. ایجاد پوشه‌های مورد نیاز
     if (mkdir(UPLOAD_ROOT.c_str(), 0777) == -1 && errno != EEXIST) {
         perror("mkdir failed for uploads");
@@ -845,11 +5139,16 @@ int main() {
         perror("mkdir failed for www");
         exit(EXIT_FAILURE);
     }
+    static_cache.set_change_listener([](const string& path) { precompressor.schedule(path); });
+    if (static_cache.start(WEB_ROOT)) {
+        log_message("کش حافظه‌ای فایل‌های استاتیک فعال شد (پایش inotify روی " + WEB_ROOT + ").");
+    }
+    precompressor.start(WEB_ROOT);
     
     // ۲. راه‌اندازی دیتابیس SQLite3
     db_manager = make_unique<DatabaseManager>();
-    if (!db_manager->open(DB_PATH)) {
-        log_message("Failure: Cannot open database.");
+    if (!db_manager->open(DB_PATH, server_config.db_readers)) {
+        log_message(LogLevel::ERROR, "Failure: Cannot open database.");
         return EXIT_FAILURE;
     }
     
@@ -861,69 +5160,102 @@ int main() {
         "email TEXT NOT NULL UNIQUE);";
         
     if (!db_manager->execute_non_query(create_table_sql)) {
-        log_message("خطا در ایجاد جدول Users.");
+        log_message(LogLevel::ERROR, "خطا در ایجاد جدول Users.");
         return EXIT_FAILURE;
     }
     log_message("ساختار دیتابیس با موفقیت آماده شد.");
     
 
-    // ۳. راه‌اندازی سوکت
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
-        exit(EXIT_FAILURE);
+    srand(time(NULL)); // مقداردهی اولیه برای تابع rand
+    
+    // ۴. ثبت مسیرها در Router
+    // مسیرهای ثابت در STATIC_ROUTE_LIST (بخش ۴) تعریف شده‌اند؛ اینجا فقط مسیرهای پارامتردار ثبت می‌شوند
+    Router router;
+    router.set_static_routes<static_route_table>();
+    router.register_route("PUT", "/api/users/:id", api_users_put_handler);
+    router.register_route("GET", "/files/*name", uploaded_file_get_handler);
+    router.register_route("DELETE", "/files/*name", files_delete_handler);
+
+    // فایل‌های استاتیک WEB_ROOT (اولویت پایین‌تر از همه مسیرهای ثابت)
+    router.register_route("GET", "/*path", static_file_get_handler);
+
+    metrics.set_route_names(router.route_names());
+
+    // لاگ دسترسی پس از ثبت همه مسیرها باز می‌شود تا جدول شناسه‌ها در سرآیند فایل کامل باشد
+    if (!server_config.access_log_path.empty()) {
+        if (access_log.open(server_config.access_log_path, router.route_names())) {
+            log_message("لاگ دسترسی دودویی: " + server_config.access_log_path);
+        } else {
+            log_message(LogLevel::WARN, "لاگ دسترسی غیرفعال شد.");
+        }
     }
     
-    // تنظیم سوکت برای استفاده مجدد از آدرس و پورت بلافاصله
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        perror("setsockopt");
-        exit(EXIT_FAILURE);
+    // ۵. استخر نخ ثابت
+    size_t worker_count = server_config.worker_threads > 0 ? server_config.worker_threads
+                                                         : max(4u, thread::hardware_concurrency() * 2);
+    ThreadPool pool(worker_count);
+
+    // ۶. سوکت(های) شنونده و حلقه‌های رویداد epoll
+    // در حالت reuseport هر هسته سوکت شنونده و حلقه رویداد خودش را دارد و کرنل اتصال‌های جدید را
+    // بین سوکت‌ها پخش می‌کند؛ در غیر این صورت یک حلقه روی نخ اصلی اجرا می‌شود.
+    vector<int> cpus = allowed_cpus();
+    size_t loop_count = 1;
+    if (server_config.reuseport) {
+        loop_count = server_config.acceptors > 0 ? server_config.acceptors : cpus.size();
     }
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY; // گوش دادن روی تمام اینترفیس‌ها
-    address.sin_port = htons(PORT);
-        
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("bind failed");
-        exit(EXIT_FAILURE);
+    bool use_uring = false;
+    if (server_config.io_engine == "uring") {
+        use_uring = UringEventLoop::is_supported();
+        if (!use_uring) {
+            log_message(LogLevel::WARN, "io_uring (با accept/recv چندباره) در این کرنل در دسترس نیست؛ استفاده از epoll.");
+        }
     }
-        
-    if (listen(server_fd, BACKLOG) < 0) {
-        perror("listen");
-        exit(EXIT_FAILURE);
+
+    vector<int> listen_fds;
+    vector<unique_ptr<EventLoop>> event_loops;
+    for (size_t i = 0; i < loop_count; ++i) {
+        int server_fd = create_listen_socket(server_config.reuseport);
+        if (server_fd < 0) {
+            exit(EXIT_FAILURE);
+        }
+        listen_fds.push_back(server_fd);
+        unique_ptr<EventLoop> event_loop;
+        if (use_uring) {
+            event_loop = make_unique<UringEventLoop>(server_fd, router, pool);
+        } else {
+            event_loop = make_unique<EpollEventLoop>(server_fd, router, pool);
+        }
+        if (!event_loop->init()) {
+            exit(EXIT_FAILURE);
+        }
+        event_loops.push_back(move(event_loop));
     }
-    
-    srand(time(NULL)); // مقداردهی اولیه برای تابع rand
-    
-    // ۴. ثبت مسیرها در Router
-    Router router;
-    // CRUD API: Users
-    router.register_route("GET", "/api/users", api_users_get_handler);
-    router.register_route("POST", "/api/users", api_users_post_handler);
-    router.register_route("PUT", "/api/users/", api_users_put_handler); // Wildcard
-    
-    // File Manager
-    router.register_route("GET", "/files", files_get_handler);
-    router.register_route("POST", "/upload", upload_post_handler);
-    router.register_route("DELETE", "/files/", files_delete_handler); // Wildcard
 
-    // Utility
-    router.register_route("GET", "/count", count_get_handler);
-    
-    cout << "وب سرور C++ شما (با Persistence و ماژولار) در حال اجرا است. پورت: " << PORT << endl;
+    logger.flush(); // پیام‌های راه‌اندازی پیش از اعلام آماده بودن سرور چاپ شوند
+    {
+        lock_guard<mutex> lock(cout_mutex);
+        cout << "وب سرور C++ شما (با Persistence و ماژولار) در حال اجرا است. پورت: " << PORT
+             << " | نخ‌های پردازشگر: " << worker_count
+             << " | حلقه‌های پذیرش: " << loop_count << (server_config.reuseport ? " (SO_REUSEPORT)" : "")
+             << " | موتور I/O: " << (use_uring ? "io_uring" : "epoll") << endl;
+    }
     
-    // ۵. حلقه اصلی پذیرش اتصال
-    while (true) {
-        if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-            perror("accept");
-            continue; 
+    if (loop_count == 1) {
+        event_loops[0]->run();
+    } else {
+        vector<thread> loop_threads;
+        for (size_t i = 0; i < loop_count; ++i) {
+            loop_threads.emplace_back(&EventLoop::run, event_loops[i].get());
+            pin_thread_to_cpu(loop_threads.back(), cpus[i % cpus.size()]);
+        }
+        for (auto& t : loop_threads) {
+            t.join();
         }
-        
-        // ایجاد یک نخ (Thread) جدید برای هر کلاینت
-        thread client_thread(handle_client, new_socket, ref(router));
-        client_thread.detach(); // جدا کردن نخ برای اجرای مستقل
     }
     
+    for (int fd : listen_fds) {
+        close(fd);
+    }
     return 0;
 }